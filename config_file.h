@@ -0,0 +1,102 @@
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+/* Helpers shared by the configuration file parsers of controller and controlled, included after the system headers
+ * they need like the *.config.h headers */
+
+static char* strdup_or_null(const char* string) {
+	char* copy;
+	if (string == NULL)
+		return NULL;
+	copy = strdup(string);
+	assert(copy != NULL);
+	return copy;
+}
+
+static char* next_token(char** cursor) {
+	char* token;
+
+	*cursor += strspn(*cursor, " \t");
+	if (**cursor == '\0')
+		return NULL;
+	token = *cursor;
+	*cursor += strcspn(*cursor, " \t");
+	if (**cursor != '\0')
+		*(*cursor)++ = '\0';
+	return token;
+}
+
+static int parse_number(const char* token, unsigned long max, unsigned long* number) {
+	char* end;
+	if (token == NULL)
+		return -1;
+	errno = 0;
+	*number = strtoul(token, &end, 0);
+	if (errno != 0 || *end != '\0' || end == token || *number > max)
+		return -1;
+	return 0;
+}
+
+/* Device IDs are either numbers or 4 characters strings like KBRD, built the same way as the KBRD macro */
+static int parse_device_id(const char* token, uint32_t* device_id) {
+	unsigned long number;
+	if (token != NULL && strlen(token) == 4 && parse_number(token, UINT32_MAX, &number) < 0) {
+		*device_id = (uint32_t)(uint8_t)token[0] << 24 | (uint32_t)(uint8_t)token[1] << 16 |
+			     (uint32_t)(uint8_t)token[2] << 8 | (uint8_t)token[3];
+		return 0;
+	}
+	if (parse_number(token, UINT32_MAX, &number) < 0)
+		return -1;
+	*device_id = number;
+	return 0;
+}
+
+/* Watches the directory of the configuration file since most editors replace the file instead of writing to it */
+static int watch_config_file(const char* config_path) {
+	char* directory = strdup(config_path);
+	char* last_slash;
+	int fd;
+
+	assert(directory != NULL);
+	last_slash = strrchr(directory, '/');
+	if (last_slash == NULL)
+		strcpy(directory, ".");
+	else if (last_slash == directory)
+		last_slash[1] = '\0';
+	else
+		*last_slash = '\0';
+
+	fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0) {
+		perror("inotify_init1");
+		free(directory);
+		return -1;
+	}
+	if (inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("inotify_add_watch");
+		close(fd);
+		free(directory);
+		return -1;
+	}
+	free(directory);
+	return fd;
+}
+
+static bool config_file_changed(int inotify_fd, const char* config_path) {
+	const char* config_name = strrchr(config_path, '/') != NULL ? strrchr(config_path, '/') + 1 : config_path;
+	uint8_t buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t read_bytes;
+
+	while ((read_bytes = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+		for (ssize_t offset = 0; offset < read_bytes;) {
+			const struct inotify_event* event = (const struct inotify_event*)&buffer[offset];
+			if (event->len != 0 && strcmp(event->name, config_name) == 0)
+				changed = true;
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+
+#endif
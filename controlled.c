@@ -1,11 +1,17 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -20,6 +26,7 @@
 #define LISTEN_NETWORK 1
 #define LISTEN_UNIX 2
 
+#include "config_file.h"
 #include "controlled.config.h"
 
 struct event_message {
@@ -29,16 +36,60 @@ struct event_message {
 	int32_t event_value;
 } __attribute__((packed));
 
-static struct libevdev_uinput* uinput_devices[sizeof(devices) / sizeof(struct device_config)];
-static const size_t devices_len = sizeof(devices) / sizeof(struct device_config);
-static int stop_triggered;
+/* Pseudo event types describing a device, see announce_devices in controller.c */
+#define INMPX_EV_PROPERTY 0x100
+#define INMPX_EV_ABS_MINIMUM 0x101
+#define INMPX_EV_ABS_MAXIMUM 0x102
+#define INMPX_EV_ABS_FUZZ 0x103
+#define INMPX_EV_ABS_FLAT 0x104
+#define INMPX_EV_ABS_RESOLUTION 0x105
+#define INMPX_EV_REP 0x106
+#define INMPX_EV_ANNOUNCE_END 0x1FF
+
+struct device_event {
+	unsigned int event_type;
+	/* -1 when only the type is enabled */
+	unsigned int event_code;
+};
+
+struct device {
+	char* device_file_link;
+	char* device_name;
+	uint32_t device_id;
+	size_t events_len;
+	struct device_event* events;
+	struct libevdev_uinput* uidevice;
+
+	/* Bit of every EV_ABS code in events. Devices with absolute axes are created once the controller announced
+	 * the source device since the absinfo of their axes is taken from it. */
+	uint64_t abs_codes;
+	struct input_absinfo absinfo[ABS_CNT];
+	/* Bit of every axis whose absinfo was received */
+	uint64_t absinfo_received;
+	uint32_t properties;
+	/* Devices with keyboard keys repeat them, the controller doesn't forward repeat events */
+	bool repeat;
+	int rep[REP_CNT];
+	/* The announcements received since uidevice was created changed the device */
+	bool stale;
+};
+
+/* controlled is single threaded, a reload builds a new runtime_config and swaps it in between two messages */
+struct runtime_config {
+	size_t devices_len;
+	struct device* devices;
+};
+
+static struct runtime_config* current_config = NULL;
+static const char* config_path = NULL;
 
 #ifdef ENCRYPTED_CONNECTION
 static uint8_t encryption_key[hydro_secretbox_KEYBYTES];
 #endif
 
 #if defined(LISTEN_MODE) && LISTEN_MODE == LISTEN_NETWORK
-static int setup_socket(void) {
+/* The priority socket listens on listen_port + 1 */
+static int setup_socket(bool priority) {
 	int listening_socket;
 	int reuseaddr_value;
 	struct sockaddr_in socket_name;
@@ -56,7 +107,7 @@ static int setup_socket(void) {
 	}
 
 	socket_name.sin_family = AF_INET;
-	socket_name.sin_port = htons(listen_port);
+	socket_name.sin_port = htons(listen_port + priority);
 	if (inet_aton(listen_address, &socket_name.sin_addr) == 0) {
 		fprintf(stderr, "inet_aton: Invalid listen_address\n");
 		return -1;
@@ -69,7 +120,8 @@ static int setup_socket(void) {
 	return listening_socket;
 }
 
-static int close_socket(int listening_socket) {
+static int close_socket(int listening_socket, bool priority) {
+	(void)priority;
 	if (close(listening_socket) < 0) {
 		perror("close");
 		return -1;
@@ -77,9 +129,14 @@ static int close_socket(int listening_socket) {
 	return 0;
 }
 #elif defined(LISTEN_MODE) && LISTEN_MODE == LISTEN_UNIX
-static int setup_socket(void) {
+/* The priority socket listens on listen_path with the "-priority" suffix */
+static void get_socket_path(char* path, size_t path_len, bool priority) {
+	snprintf(path, path_len, "%s%s", listen_path, priority ? "-priority" : "");
+}
+
+static int setup_socket(bool priority) {
 	int listening_socket;
-	struct sockaddr_un socket_name;
+	struct sockaddr_un socket_name = {0};
 
 	listening_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
 	if (listening_socket < 0) {
@@ -88,30 +145,33 @@ static int setup_socket(void) {
 	}
 
 	socket_name.sun_family = AF_UNIX;
-	strncpy(socket_name.sun_path, listen_path, sizeof(socket_name.sun_path) - 1);
+	get_socket_path(socket_name.sun_path, sizeof(socket_name.sun_path), priority);
 
 	if (bind(listening_socket, (struct sockaddr*)&socket_name, sizeof(socket_name)) < 0) {
 		perror("bind");
 		return -1;
 	}
 
-	if (chmod(listen_path, socket_mode) < 0) {
+	if (chmod(socket_name.sun_path, socket_mode) < 0) {
 		perror("chmod");
 		return -1;
 	}
-	if (chown(listen_path, socket_owner, socket_group) < 0) {
+	if (chown(socket_name.sun_path, socket_owner, socket_group) < 0) {
 		perror("chown");
 		return -1;
 	}
 	return listening_socket;
 }
 
-static int close_socket(int listening_socket) {
+static int close_socket(int listening_socket, bool priority) {
+	char path[sizeof(((struct sockaddr_un*)NULL)->sun_path)];
+
 	if (close(listening_socket) < 0) {
 		perror("close");
 		return -1;
 	}
-	if (unlink(listen_path) < 0) {
+	get_socket_path(path, sizeof(path), priority);
+	if (unlink(path) < 0) {
 		perror("unlink");
 		return -1;
 	}
@@ -119,9 +179,8 @@ static int close_socket(int listening_socket) {
 }
 #endif
 
-static struct libevdev_uinput* setup_device(const struct device_config* config) {
+static struct libevdev_uinput* setup_device(const struct device* config) {
 	int err;
-	size_t event_type_i, event_code_i;
 	struct libevdev* device;
 	struct libevdev_uinput* uidevice;
 
@@ -129,16 +188,26 @@ static struct libevdev_uinput* setup_device(const struct device_config* config)
 	assert(device != NULL);
 	libevdev_set_name(device, config->device_name);
 
-	event_code_i = event_type_i = 0;
-	for (; config->enabled_event_types[event_type_i] != (unsigned int)-1; event_type_i++) {
-		unsigned int current_event_type = config->enabled_event_types[event_type_i];
-		assert(libevdev_enable_event_type(device, current_event_type) == 0);
-		for (; config->enabled_event_codes[event_code_i] != (unsigned int)-1; event_code_i++) {
-			unsigned int current_event_code = config->enabled_event_codes[event_code_i];
-			assert(libevdev_enable_event_code(device, current_event_type, current_event_code, NULL) == 0);
+	for (unsigned int property = 0; property < INPUT_PROP_CNT; property++) {
+		if (config->properties & (1u << property))
+			assert(libevdev_enable_property(device, property) == 0);
+	}
+	for (size_t i = 0; i < config->events_len; i++) {
+		const struct device_event* event = &config->events[i];
+		const void* data = NULL;
+		if (event->event_type == EV_ABS && event->event_code != (unsigned int)-1) {
+			/* Axes the source device doesn't have are left out */
+			if (!(config->absinfo_received & (1ull << event->event_code)))
+				continue;
+			data = &config->absinfo[event->event_code];
 		}
-		/* We skip the -1 */
-		event_code_i++;
+		assert(libevdev_enable_event_type(device, event->event_type) == 0);
+		if (event->event_code != (unsigned int)-1)
+			assert(libevdev_enable_event_code(device, event->event_type, event->event_code, data) == 0);
+	}
+	if (config->repeat) {
+		assert(libevdev_enable_event_code(device, EV_REP, REP_DELAY, &config->rep[REP_DELAY]) == 0);
+		assert(libevdev_enable_event_code(device, EV_REP, REP_PERIOD, &config->rep[REP_PERIOD]) == 0);
 	}
 
 	err = libevdev_uinput_create_from_device(device, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidevice);
@@ -149,23 +218,274 @@ static struct libevdev_uinput* setup_device(const struct device_config* config)
 	}
 	libevdev_free(device);
 
-	if (config->device_file_link != NULL) {
-		const char* uinput_devnode = libevdev_uinput_get_devnode(uidevice);
+	/* uinput devices start with the default repeat settings of the kernel */
+	for (unsigned int code = 0; config->repeat && code < REP_CNT; code++) {
+		err = libevdev_uinput_write_event(uidevice, EV_REP, code, config->rep[code]);
+		if (err < 0)
+			fprintf(stderr, "libevdev_uinput_write_event: %s\n", strerror(-err));
+	}
+	return uidevice;
+}
+
+/* Done once every device of a configuration is created so a failed reload doesn't touch the links of the previous
+ * one */
+static int link_device(const struct device* device) {
+	if (device->device_file_link != NULL) {
+		const char* uinput_devnode = libevdev_uinput_get_devnode(device->uidevice);
 		assert(uinput_devnode != NULL);
-		if (symlink(uinput_devnode, config->device_file_link) < 0) {
+		if (symlink(uinput_devnode, device->device_file_link) < 0) {
 			perror("symlink");
-			return NULL;
+			return -1;
 		};
 	}
-	return uidevice;
+	return 0;
+}
+
+static void destroy_device(struct device* device, bool unlink_device) {
+	if (device->uidevice == NULL)
+		return;
+	libevdev_uinput_destroy(device->uidevice);
+	device->uidevice = NULL;
+	if (unlink_device && device->device_file_link != NULL && unlink(device->device_file_link) < 0)
+		perror("unlink");
 }
 
 static void close_devices(void) {
 	size_t i;
-	for (i = 0; i < devices_len; i++) {
-		if (uinput_devices[i] != NULL)
-			libevdev_uinput_destroy(uinput_devices[i]);
+	for (i = 0; current_config != NULL && i < current_config->devices_len; i++)
+		destroy_device(&current_config->devices[i], false);
+}
+
+static struct device* add_device(struct runtime_config* config, const char* device_file_link,
+				 const char* device_name, uint32_t device_id) {
+	struct device* device;
+	config->devices = realloc(config->devices, (config->devices_len + 1) * sizeof(struct device));
+	assert(config->devices != NULL);
+	device = &config->devices[config->devices_len++];
+	memset(device, 0, sizeof(struct device));
+	device->device_file_link = strdup_or_null(device_file_link);
+	device->device_name = strdup_or_null(device_name);
+	device->device_id = device_id;
+	/* Until the controller announces the ones of the source device */
+	device->rep[REP_DELAY] = 250;
+	device->rep[REP_PERIOD] = 33;
+	return device;
+}
+
+static int add_device_event(struct device* device, unsigned int event_type, unsigned int event_code) {
+	if (event_type == EV_ABS && event_code != (unsigned int)-1) {
+		if (event_code >= ABS_CNT)
+			return -1;
+		device->abs_codes |= 1ull << event_code;
+	}
+	if (event_type == EV_KEY && event_code < BTN_MISC)
+		device->repeat = true;
+	device->events = realloc(device->events, (device->events_len + 1) * sizeof(struct device_event));
+	assert(device->events != NULL);
+	device->events[device->events_len].event_type = event_type;
+	device->events[device->events_len++].event_code = event_code;
+	return 0;
+}
+
+static void free_config(struct runtime_config* config) {
+	for (size_t i = 0; i < config->devices_len; i++) {
+		free(config->devices[i].device_file_link);
+		free(config->devices[i].device_name);
+		free(config->devices[i].events);
+	}
+	free(config->devices);
+	free(config);
+}
+
+/* Builds a runtime_config from the devices of controlled.config.h, used when no configuration file is given */
+static struct runtime_config* load_default_config(void) {
+	struct runtime_config* config = calloc(1, sizeof(struct runtime_config));
+	assert(config != NULL);
+
+	for (size_t i = 0; i < sizeof(devices) / sizeof(struct device_config); i++) {
+		struct device* device =
+			add_device(config, devices[i].device_file_link, devices[i].device_name, devices[i].device_id);
+		size_t event_type_i, event_code_i;
+
+		event_code_i = event_type_i = 0;
+		for (; devices[i].enabled_event_types[event_type_i] != (unsigned int)-1; event_type_i++) {
+			unsigned int current_event_type = devices[i].enabled_event_types[event_type_i];
+			if (devices[i].enabled_event_codes[event_code_i] == (unsigned int)-1)
+				add_device_event(device, current_event_type, -1);
+			for (; devices[i].enabled_event_codes[event_code_i] != (unsigned int)-1; event_code_i++) {
+				unsigned int current_event_code = devices[i].enabled_event_codes[event_code_i];
+				add_device_event(device, current_event_type, current_event_code);
+			}
+			/* We skip the -1 */
+			event_code_i++;
+		}
+	}
+	return config;
+}
+
+/* Event types and codes are either their name (EV_KEY, KEY_ESC...) or a number */
+static int parse_event(const char* token, int event_type, unsigned int* event) {
+	unsigned long number;
+	int parsed;
+	if (token == NULL)
+		return -1;
+	if (event_type < 0)
+		parsed = libevdev_event_type_from_name(token);
+	else
+		parsed = libevdev_event_code_from_name(event_type, token);
+	if (parsed >= 0) {
+		*event = parsed;
+		return 0;
+	}
+	if (parse_number(token, event_type < 0 ? EV_MAX : KEY_MAX, &number) < 0)
+		return -1;
+	*event = number;
+	return 0;
+}
+
+static int parse_config_line(struct runtime_config* config, char* line) {
+	char* cursor = line;
+	char* directive = next_token(&cursor);
+	uint32_t device_id;
+
+	if (directive == NULL || directive[0] == '#')
+		return 0;
+	if (parse_device_id(next_token(&cursor), &device_id) < 0)
+		return -1;
+
+	if (strcmp(directive, "device") == 0) {
+		/* device ID LINK|- NAME... */
+		char* device_file_link = next_token(&cursor);
+		cursor += strspn(cursor, " \t");
+		if (device_file_link == NULL || *cursor == '\0')
+			return -1;
+		add_device(config, strcmp(device_file_link, "-") != 0 ? device_file_link : NULL, cursor, device_id);
+	} else if (strcmp(directive, "events") == 0) {
+		/* events ID TYPE [CODE...] */
+		struct device* device = NULL;
+		unsigned int event_type, event_code;
+		char* token;
+		for (size_t i = 0; i < config->devices_len; i++) {
+			if (config->devices[i].device_id == device_id)
+				device = &config->devices[i];
+		}
+		if (device == NULL || parse_event(next_token(&cursor), -1, &event_type) < 0)
+			return -1;
+		token = next_token(&cursor);
+		if (token == NULL)
+			add_device_event(device, event_type, -1);
+		for (; token != NULL; token = next_token(&cursor)) {
+			if (parse_event(token, event_type, &event_code) < 0 ||
+			    add_device_event(device, event_type, event_code) < 0)
+				return -1;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static struct runtime_config* load_config_file(const char* path) {
+	struct runtime_config* config;
+	char* line = NULL;
+	size_t line_size = 0, line_number = 0;
+	FILE* file;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror("fopen");
+		return NULL;
+	}
+	config = calloc(1, sizeof(struct runtime_config));
+	assert(config != NULL);
+
+	while (getline(&line, &line_size, file) >= 0) {
+		line_number++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (parse_config_line(config, line) < 0) {
+			fprintf(stderr, "%s:%zu: Invalid line\n", path, line_number);
+			free(line);
+			fclose(file);
+			free_config(config);
+			return NULL;
+		}
+	}
+	free(line);
+	fclose(file);
+	return config;
+}
+
+static bool same_device(const struct device* a, const struct device* b) {
+	return a->device_id == b->device_id && strcmp(a->device_name, b->device_name) == 0 &&
+	       (a->device_file_link == NULL) == (b->device_file_link == NULL) &&
+	       (a->device_file_link == NULL || strcmp(a->device_file_link, b->device_file_link) == 0) &&
+	       a->events_len == b->events_len &&
+	       memcmp(a->events, b->events, a->events_len * sizeof(struct device_event)) == 0;
+}
+
+/* Creates the uinput devices of config, the ones described exactly the same way in old_config (which may be NULL) are
+ * moved to config instead so programs using them don't notice the reload.
+ * Returns -1 if a device couldn't be created, old_config is then left untouched, and -2 if config was applied but some
+ * links couldn't be created. */
+static int apply_config(struct runtime_config* config, struct runtime_config* old_config) {
+	size_t reused_from[config->devices_len + 1];
+	size_t i, j;
+	int ret = 0;
+
+	for (i = 0; i < config->devices_len; i++) {
+		reused_from[i] = SIZE_MAX;
+		/* What was announced about the source device still holds */
+		for (j = 0; old_config != NULL && j < old_config->devices_len; j++) {
+			const struct device* old_device = &old_config->devices[j];
+			if (old_device->device_id == config->devices[i].device_id) {
+				memcpy(config->devices[i].absinfo, old_device->absinfo, sizeof(old_device->absinfo));
+				config->devices[i].absinfo_received = old_device->absinfo_received;
+				config->devices[i].properties = old_device->properties;
+				memcpy(config->devices[i].rep, old_device->rep, sizeof(old_device->rep));
+				config->devices[i].stale = old_device->stale;
+				break;
+			}
+		}
+		for (j = 0; old_config != NULL && j < old_config->devices_len; j++) {
+			if (old_config->devices[j].uidevice != NULL &&
+			    same_device(&config->devices[i], &old_config->devices[j])) {
+				config->devices[i].uidevice = old_config->devices[j].uidevice;
+				old_config->devices[j].uidevice = NULL;
+				reused_from[i] = j;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < config->devices_len; i++) {
+		if (reused_from[i] != SIZE_MAX)
+			continue;
+		/* Created by handle_announcement */
+		if (config->devices[i].abs_codes != 0 && config->devices[i].absinfo_received == 0)
+			continue;
+		config->devices[i].uidevice = setup_device(&config->devices[i]);
+		if (config->devices[i].uidevice == NULL) {
+			for (j = 0; j < config->devices_len; j++) {
+				if (reused_from[j] != SIZE_MAX) {
+					old_config->devices[reused_from[j]].uidevice = config->devices[j].uidevice;
+					config->devices[j].uidevice = NULL;
+				} else {
+					destroy_device(&config->devices[j], false);
+				}
+			}
+			return -1;
+		}
+	}
+
+	/* Devices left in old_config were removed or changed, their links are replaced by the new devices */
+	for (j = 0; old_config != NULL && j < old_config->devices_len; j++)
+		destroy_device(&old_config->devices[j], true);
+	for (i = 0; i < config->devices_len; i++) {
+		if (reused_from[i] == SIZE_MAX && config->devices[i].uidevice != NULL &&
+		    link_device(&config->devices[i]) < 0)
+			ret = -2;
 	}
+	return ret;
 }
 
 #ifdef ENCRYPTED_CONNECTION
@@ -242,86 +562,271 @@ static int recv_message(int listening_socket, struct event_message* recved_messa
 	return 0;
 }
 
-static void signal_handler(int signo) {
-	switch (signo) {
-		case SIGINT:
-		case SIGTERM:
-			stop_triggered = 1;
+static void reload_config(void) {
+	struct runtime_config* new_config;
+
+	if (config_path == NULL) {
+		fprintf(stderr, "reload_config: No configuration file to reload\n");
+		return;
+	}
+	new_config = load_config_file(config_path);
+	if (new_config == NULL)
+		return;
+	if (apply_config(new_config, current_config) == -1) {
+		fprintf(stderr, "reload_config: Keeping the previous configuration\n");
+		free_config(new_config);
+		return;
+	}
+	free_config(current_config);
+	current_config = new_config;
+	fprintf(stderr, "reload_config: Loaded %s\n", config_path);
+}
+
+static void handle_announcement(struct device* device, const struct event_message* message) {
+	unsigned int code = message->event_code;
+	bool axis_message =
+		message->event_type >= INMPX_EV_ABS_MINIMUM && message->event_type <= INMPX_EV_ABS_RESOLUTION;
+	int32_t* field;
+
+	if (message->event_type == INMPX_EV_REP) {
+		if (!device->repeat || code >= REP_CNT || message->event_value < 0 ||
+		    device->rep[code] == message->event_value)
+			return;
+		device->rep[code] = message->event_value;
+		if (device->uidevice != NULL) {
+			int err = libevdev_uinput_write_event(device->uidevice, EV_REP, code, message->event_value);
+			if (err < 0)
+				fprintf(stderr, "libevdev_uinput_write_event: %s\n", strerror(-err));
+		}
+		return;
+	}
+
+	/* Only devices with absolute axes are created from announcements */
+	if (device->abs_codes == 0 || (axis_message && (code >= ABS_CNT || !(device->abs_codes & (1ull << code)))))
+		return;
+
+	switch (message->event_type) {
+		case INMPX_EV_PROPERTY:
+			if (code < INPUT_PROP_CNT && !(device->properties & (1u << code))) {
+				device->properties |= 1u << code;
+				device->stale = device->uidevice != NULL;
+			}
+			return;
+		case INMPX_EV_ANNOUNCE_END:
+			if (device->uidevice != NULL && !device->stale)
+				return;
+			destroy_device(device, true);
+			device->stale = false;
+			device->uidevice = setup_device(device);
+			if (device->uidevice != NULL)
+				link_device(device);
+			return;
+		case INMPX_EV_ABS_MINIMUM:
+			field = &device->absinfo[code].minimum;
 			break;
-		default:
+		case INMPX_EV_ABS_MAXIMUM:
+			field = &device->absinfo[code].maximum;
+			break;
+		case INMPX_EV_ABS_FUZZ:
+			field = &device->absinfo[code].fuzz;
+			break;
+		case INMPX_EV_ABS_FLAT:
+			field = &device->absinfo[code].flat;
+			break;
+		case INMPX_EV_ABS_RESOLUTION:
+			field = &device->absinfo[code].resolution;
 			break;
+		default:
+			return;
+	}
+
+	if (*field != message->event_value) {
+		*field = message->event_value;
+		device->stale = device->uidevice != NULL;
+	}
+	if (message->event_type == INMPX_EV_ABS_RESOLUTION && !(device->absinfo_received & (1ull << code))) {
+		device->absinfo_received |= 1ull << code;
+		device->stale = device->uidevice != NULL;
 	}
 }
 
-int main(void) {
+/* Returns -1 if controlled must stop */
+static int handle_message(int listening_socket) {
+	struct event_message recved_message;
+	struct device* device = NULL;
 	size_t i;
-	int listening_socket;
-	int ret, err;
+	int err;
 
-#ifdef ENCRYPTED_CONNECTION
-	if (read_encryption_key() < 0) {
+	err = recv_message(listening_socket, &recved_message);
+	if (err == -1) {
+		return 0;
+	} else if (err < -1) {
 		return -1;
 	}
-#endif
 
-	listening_socket = setup_socket();
-	if (listening_socket < 0) {
-		close_socket(listening_socket);
-		return -1;
+	for (i = 0; i < current_config->devices_len; i++) {
+		if (current_config->devices[i].device_id == recved_message.device_id) {
+			device = &current_config->devices[i];
+			break;
+		}
+	}
+	if (device == NULL) {
+		/* Every device of the controller is announced, even the ones this controlled doesn't replay */
+		if (recved_message.event_type < INMPX_EV_PROPERTY)
+			fprintf(stderr,
+				"main: recved message with invalid device ID : "
+				"%08X\n",
+				recved_message.device_id);
+		return 0;
 	}
 
-	for (i = 0; i < devices_len; i++) {
-		uinput_devices[i] = setup_device(&devices[i]);
-		if (uinput_devices[i] == NULL) {
-			close_socket(listening_socket);
-			close_devices();
+	if (recved_message.event_type >= INMPX_EV_PROPERTY) {
+		handle_announcement(device, &recved_message);
+	} else if (device->uidevice != NULL) {
+		err = libevdev_uinput_write_event(device->uidevice, recved_message.event_type,
+						  recved_message.event_code, recved_message.event_value);
+		if (err < 0) {
+			fprintf(stderr, "libevdev_uinput_write_event: %s\n", strerror(-err));
 			return -1;
 		}
 	}
+	/* Events of devices waiting for the announcement of their source device are dropped */
+	return 0;
+}
 
-	struct sigaction int_handler = {.sa_handler = signal_handler};
-	sigaction(SIGINT, &int_handler, NULL);
-	sigaction(SIGTERM, &int_handler, NULL);
+/* Returns on SIGINT or SIGTERM, reloads the configuration on SIGHUP and when the configuration file changes.
+ * priority_socket is -1 when PRIORITY_SOCKET is disabled. */
+static int main_loop(int listening_socket, int priority_socket, const sigset_t* handled_signals) {
+	struct pollfd fds[4] = {
+		{.fd = listening_socket, .events = POLLIN},
+		{.fd = -1, .events = POLLIN},
+		{.fd = -1, .events = POLLIN},
+		{.fd = priority_socket, .events = POLLIN},
+	};
+	int ret = 0;
 
-	stop_triggered = 0;
-	ret = 0;
-	while (!stop_triggered) {
-		struct event_message recved_message;
-		ssize_t current_message_device_index;
-		err = recv_message(listening_socket, &recved_message);
-		if (err == -1) {
-			continue;
-		} else if (err < -1) {
-			stop_triggered = 1;
+	fds[1].fd = signalfd(-1, handled_signals, SFD_CLOEXEC);
+	if (fds[1].fd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+	if (config_path != NULL)
+		fds[2].fd = watch_config_file(config_path);
+
+	for (;;) {
+		if (poll(fds, 4, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			ret = -1;
 			break;
 		}
-
-		for (i = 0, current_message_device_index = -1; i < devices_len; i++) {
-			if (devices[i].device_id == recved_message.device_id) {
-				current_message_device_index = i;
+		/* Key events never wait behind the motion queued in the other socket, it's only read once the priority
+		 * socket is empty */
+		if (fds[3].revents & POLLIN) {
+			if (handle_message(priority_socket) < 0) {
+				ret = -1;
 				break;
 			}
+			continue;
 		}
-		if (current_message_device_index != -1) {
-			err = libevdev_uinput_write_event(uinput_devices[current_message_device_index],
-							  recved_message.event_type, recved_message.event_code,
-							  recved_message.event_value);
-			if (err < 0) {
-				fprintf(stderr, "libevdev_uinput_write_event: %s\n", strerror(-err));
-				stop_triggered = 1;
+		if ((fds[0].revents & POLLIN) && handle_message(listening_socket) < 0) {
+			ret = -1;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo siginfo;
+			if (read(fds[1].fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
+				perror("read");
 				ret = -1;
 				break;
 			}
-		} else {
-			fprintf(stderr,
-				"main: recved message with invalid device ID : "
-				"%08X\n",
-				recved_message.device_id);
+			if (siginfo.ssi_signo != SIGHUP)
+				break;
+			reload_config();
 		}
+		if (fds[2].fd >= 0 && (fds[2].revents & POLLIN) && config_file_changed(fds[2].fd, config_path))
+			reload_config();
+	}
+
+	close(fds[1].fd);
+	if (fds[2].fd >= 0)
+		close(fds[2].fd);
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	int listening_socket;
+	int priority_socket = -1;
+	int ret, opt;
+	struct runtime_config* config;
+	sigset_t handled_signals;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+			case 'f':
+				config_path = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-f config_file]\n", argv[0]);
+				return -1;
+		}
+	}
+	if (optind != argc) {
+		fprintf(stderr, "Usage: %s [-f config_file]\n", argv[0]);
+		return -1;
 	}
 
+#ifdef ENCRYPTED_CONNECTION
+	if (read_encryption_key() < 0) {
+		return -1;
+	}
+#endif
+
+	config = config_path != NULL ? load_config_file(config_path) : load_default_config();
+	if (config == NULL) {
+		return -1;
+	}
+
+	listening_socket = setup_socket(false);
+	if (listening_socket < 0) {
+		close_socket(listening_socket, false);
+		free_config(config);
+		return -1;
+	}
+#ifdef PRIORITY_SOCKET
+	priority_socket = setup_socket(true);
+	if (priority_socket < 0) {
+		close_socket(priority_socket, true);
+		close_socket(listening_socket, false);
+		free_config(config);
+		return -1;
+	}
+#endif
+
+	current_config = config;
+	if (apply_config(config, NULL) < 0) {
+		if (priority_socket >= 0)
+			close_socket(priority_socket, true);
+		close_socket(listening_socket, false);
+		close_devices();
+		free_config(config);
+		return -1;
+	}
+
+	/* Only received through main_loop's signalfd */
+	sigemptyset(&handled_signals);
+	sigaddset(&handled_signals, SIGINT);
+	sigaddset(&handled_signals, SIGTERM);
+	sigaddset(&handled_signals, SIGHUP);
+	sigprocmask(SIG_BLOCK, &handled_signals, NULL);
+
+	ret = main_loop(listening_socket, priority_socket, &handled_signals);
+
 	close_devices();
-	close_socket(listening_socket);
+	if (priority_socket >= 0)
+		close_socket(priority_socket, true);
+	close_socket(listening_socket, false);
+	free_config(current_config);
 	return ret;
 }
@@ -4,11 +4,19 @@
 #define KBRD 0x4B425244
 #define MOUS 0x4D4F5553
 
+/* devices is the configuration used when controlled is started without -f, a configuration file (see
+ * controlled.conf.example) overrides it and can be reloaded while controlled is running. The other settings are
+ * compile-time only. */
+
 struct device_config {
-	/* WARNING : symlinks to devices are not deleted on cleanup */
+	/* WARNING : symlinks to devices are not deleted on cleanup, only when a reload removes or changes the device */
 	const char* device_file_link;
 	const char* device_name;
 	const uint32_t device_id;
+	/* Devices with EV_ABS codes (tablets, touchpads...) are only created once the controller announced the device
+	 * with the same device_id since the ranges of the axes and the properties are copied from it.
+	 * Devices with keyboard keys (below BTN_MISC) also get EV_REP, keys are repeated here with the delay and the
+	 * period of the source device since the controller doesn't forward repeat events */
 	const unsigned int* enabled_event_types;
 	const unsigned int* enabled_event_codes;
 };
@@ -94,6 +102,12 @@ static const gid_t socket_group = 0;
 #error Invalid LISTEN_MODE
 #endif
 
+/* Comment / Uncomment this line to enable the priority socket
+ * Keyboard events are received on a second socket, listening on listen_port + 1 or on listen_path with the "-priority"
+ * suffix, which is always read before the other one. It must also be enabled in controller.config.h.
+ */
+#define PRIORITY_SOCKET
+
 /* Comment / Uncomment this line to enable encrytion
  * It is heavely recommanded to enable it over UDP overwise everyone on the same network can easly read your events or
  * inject fake ones since this encryption is also used as an authentication method */
@@ -1,23 +1,33 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <hydrogen.h>
 #include <libevdev/libevdev.h>
 
+#include "config_file.h"
 #include "controller.config.h"
 
 struct event_message {
@@ -27,25 +37,320 @@ struct event_message {
 	int32_t event_value;
 } __attribute__((packed));
 
-static const size_t devices_len = sizeof(devices) / sizeof(struct device_config);
-static struct libevdev* devices_libev[sizeof(devices) / sizeof(struct device_config)];
-static pthread_t devices_thread[sizeof(devices) / sizeof(struct device_config)];
+/* Pseudo event types describing a device to controlled, they are never written to its uinput devices. event_code is
+ * the property or the axis described and an announcement ends with INMPX_EV_ANNOUNCE_END. */
+#define INMPX_EV_PROPERTY 0x100
+#define INMPX_EV_ABS_MINIMUM 0x101
+#define INMPX_EV_ABS_MAXIMUM 0x102
+#define INMPX_EV_ABS_FUZZ 0x103
+#define INMPX_EV_ABS_FLAT 0x104
+#define INMPX_EV_ABS_RESOLUTION 0x105
+/* event_code is REP_DELAY or REP_PERIOD, keys are repeated by controlled since repeat events aren't forwarded */
+#define INMPX_EV_REP 0x106
+#define INMPX_EV_ANNOUNCE_END 0x1FF
+/* Datagrams can be lost and controlled can be started after the controller, devices are thus announced again
+ * periodically */
+#define ANNOUNCE_INTERVAL_MS 2000
 
-static const size_t clients_len = sizeof(clients) / sizeof(struct client_config);
-static int clients_fd[sizeof(clients) / sizeof(struct client_config)];
-static struct sockaddr* clients_addr[sizeof(clients) / sizeof(struct client_config)];
+/* Multitouch values of slots past ABS_DEDUP_SLOTS are always sent */
+#define ABS_DEDUP_SLOTS 16
+#define ABS_MT_FIRST ABS_MT_TOUCH_MAJOR
+#define ABS_UNKNOWN INT32_MIN
+
+/* What controlled needs to create a device like the source one and whether it moves a pointer, read once when the
+ * device is opened since libevdev isn't thread safe and the device thread owns its struct libevdev */
+struct device_info {
+	uint32_t properties;
+	/* Bit of every EV_ABS code of the device */
+	uint64_t abs_codes;
+	struct input_absinfo absinfo[ABS_CNT];
+	/* The device has EV_REP, repeat is indexed by REP_DELAY and REP_PERIOD */
+	bool has_repeat;
+	bool has_rel;
+	int repeat[REP_CNT];
+};
+
+/* Capture files are made of, in host byte order :
+ * - a capture_header
+ * - capture_frames until the end of the file, one per event read from a device. A frame whose event_type is
+ *   CAPTURE_EV_DEVICE is instead followed by the capture_device describing device_id, it comes before the first event
+ *   of the device, including the devices opened by a reload during the capture.
+ * Frames are only sorted by timestamp within each flush, an event buffered by a device thread after a flush can be
+ * older than the last events of other devices written by this flush.
+ */
+#define CAPTURE_MAGIC 0x584D4E49
+#define CAPTURE_VERSION 3
+#define CAPTURE_EV_DEVICE 0xFFFF
+/* Number of frames each device can buffer between two flushes, must be a power of 2 */
+#define CAPTURE_RING_SIZE 4096
+#define CAPTURE_FLUSH_INTERVAL_NS 100000000
+
+struct capture_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t frame_size;
+	uint32_t device_size;
+} __attribute__((packed));
+
+struct capture_device {
+	uint32_t device_id;
+	char device_name[60];
+	/* Announced to the clients during the replay */
+	struct device_info info;
+} __attribute__((packed));
+
+struct capture_frame {
+	uint64_t timestamp_us;
+	uint32_t device_id;
+	uint16_t event_type;
+	uint16_t event_code;
+	int32_t event_value;
+} __attribute__((packed));
+
+/* Single producer (the device thread) single consumer (capture_thread) lock-free ring */
+struct capture_ring {
+	atomic_size_t head;
+	atomic_size_t tail;
+	/* Only accessed by capture_thread, the capture_device of the device was written with described_id, a reload may
+	 * give the device another id which must be described again */
+	bool described;
+	uint32_t described_id;
+	struct capture_frame frames[CAPTURE_RING_SIZE];
+};
+
+/* How a message is sent by send_packet */
+enum traffic_class {
+	/* Through the bulk socket */
+	TRAFFIC_BULK,
+	/* Through the bulk socket but dropped instead of waiting when it's full, for messages superseded by the next
+	 * ones like motion */
+	TRAFFIC_DROPPABLE,
+	/* Through the priority socket, for key and button events */
+	TRAFFIC_PRIORITY,
+};
+
+/* A client socket, shared by every runtime_config describing the same client so a reload doesn't reopen it */
+struct client {
+	int listen_mode;
+	char* address;
+	uint16_t port;
+	int fd;
+	struct sockaddr* addr;
+	/* -1 and NULL without PRIORITY_SOCKET, priority traffic then goes through fd */
+	int priority_fd;
+	struct sockaddr* priority_addr;
+	socklen_t addrlen;
+	/* Number of runtime_config using this client, only accessed by the main thread */
+	size_t refcount;
+};
+
+/* An opened and grabbed device and the thread reading it, shared like clients */
+struct device {
+	char* path;
+	char* name;
+	struct libevdev* libev;
+	struct device_info info;
+	pthread_t thread;
+	bool thread_started;
+	atomic_bool running;
+	/* Odd while the device thread uses a runtime_config, see wait_for_readers */
+	atomic_ulong rcu_seq;
+	/* NULL when no capture is running */
+	struct capture_ring* capture_ring;
+	size_t refcount;
+};
+
+struct client_spec {
+	int listen_mode;
+	char* address;
+	uint16_t port;
+	char* postswitch_command;
+};
+
+struct device_spec {
+	char* path;
+	uint32_t device_id;
+};
+
+struct layer {
+	uint32_t device_id;
+	unsigned int layer_key;
+	unsigned int layer;
+};
+
+struct remap {
+	uint32_t device_id;
+	size_t client;
+	unsigned int layer;
+	unsigned int from;
+	int mode;
+	unsigned int* to;
+	size_t to_len;
+};
+
+struct route {
+	uint32_t device_id;
+	size_t* clients;
+	size_t clients_len;
+};
+
+enum edge { EDGE_LEFT, EDGE_RIGHT, EDGE_UP, EDGE_DOWN };
+
+struct screen {
+	size_t client;
+	/* Width and height */
+	int32_t size[2];
+	/* Indexed by enum edge, NO_NEIGHBOUR if the cursor stops at this edge */
+	size_t neighbours[4];
+};
+
+/* Position of the virtual cursor on the screen of a client, indexed by axis (0 for REL_X, 1 for REL_Y) */
+struct cursor {
+	int32_t position[2];
+};
+
+/* Everything the event path needs. A runtime_config is never modified once it is published in current_config :
+ * reloading builds a new one off to the side, swaps current_config and frees the old one once no reader can be using
+ * it anymore. */
+struct runtime_config {
+	/* Unique to each runtime_config, readers compare it instead of the address of the config since a new config
+	 * can be allocated where a freed one was */
+	unsigned long generation;
+
+	size_t clients_len;
+	struct client_spec* client_specs;
+	struct client** clients;
+	size_t* all_clients;
+
+	size_t devices_len;
+	struct device_spec* device_specs;
+	/* Entries are NULL when replaying a capture */
+	struct device** devices;
+
+	uint32_t switchable_device;
+	unsigned int switch_modifier;
+	unsigned int switch_key;
+
+	size_t passthrough_client;
+	size_t passthrough_keys_len;
+	unsigned int* passthrough_keys;
+
+	size_t layers_len;
+	struct layer* layers;
+	size_t remaps_len;
+	struct remap* remaps;
+	size_t routes_len;
+	struct route* routes;
+	uint32_t edge_switching_device;
+	size_t screens_len;
+	struct screen* screens;
+
+	/* Flat tables built by compile_config :
+	 * - passthrough_table[key] is true if key is a passthrough key
+	 * - route_clients[device * clients_len] lists the route_clients_len[device] clients the device is always sent
+	 *   to, devices with an empty list follow current_client
+	 * - remap_table[((device * clients_len + client) * REMAP_LAYERS + layer) * KEY_CNT + key] is the index in
+	 *   remaps + 1 of the remap applied to key, 0 if the key is sent as is. It's NULL when there is no remap nor
+	 *   layer.
+	 * - layer_table[device * KEY_CNT + key] is the layer activated by key, 0 if it's not a layer key
+	 * - client_screens[client] is the screen of client, NULL if it has none. It's NULL when edge switching is
+	 *   disabled, edge_device_index is then -1.
+	 */
+	bool passthrough_table[KEY_CNT];
+	size_t* route_clients;
+	size_t* route_clients_len;
+	uint16_t* remap_table;
+	uint8_t* layer_table;
+	const struct screen** client_screens;
+	ssize_t edge_device_index;
+};
+
+/* Values of the absolute axes of a device as last sent to its destination, used to drop the events that wouldn't
+ * change anything there */
+struct abs_state {
+	/* Destination of the values below, they are forgotten when it changes */
+	size_t client_index;
+	size_t clients_count;
+	int32_t values[ABS_CNT];
+	int32_t mt_values[ABS_DEDUP_SLOTS][ABS_CNT - ABS_MT_FIRST];
+	/* Slot selected by the device, -1 until it selects one */
+	int32_t slot;
+	/* Slot selected on the destination, -1 if unknown */
+	int32_t sent_slot;
+	bool frame_empty;
+};
+
+/* Words of a bitmap of every key code */
+#define KEY_WORDS ((KEY_CNT + 63) / 64)
+
+/* What the reader of a device (its thread or the replay) remembers between events, reset when the runtime_config
+ * changes. Keys sent by chords held during a reload are released since the remaps may have changed, keys sent as is
+ * stay pressed on the clients that are still part of the new config. */
+struct device_state {
+	const struct runtime_config* config;
+	/* Generation of config, 0 before the first event */
+	unsigned long config_generation;
+	ssize_t device_index;
+	/* Bit of every layer whose key is currently held */
+	unsigned int layer_state;
+	/* Keys pressed on each client of config and not released yet, keys_down for the keys sent as is and
+	 * chords_down for the keys sent by chord remaps. Indexed by client * KEY_WORDS + key / 64. */
+	uint64_t* keys_down;
+	uint64_t* chords_down;
+	/* config->clients and the id of the device when the keys above were pressed, they are still needed to release
+	 * them once config is freed */
+	struct client** key_clients;
+	size_t key_clients_len;
+	uint32_t device_id;
+	/* Value of current_client when the device last followed it, the keys held there are released once it changes so
+	 * they aren't stuck (and repeated by controlled) on a client that doesn't receive the device anymore */
+	size_t followed_client;
+	/* remap_pressed[client * KEY_CNT + key] is the remap_table entry used when key was pressed, so it is released
+	 * the same way even if the layer changed in between */
+	uint16_t* remap_pressed;
+	/* Only allocated for the edge switching device, indexed by client */
+	struct cursor* cursors;
+	/* Bit of every button (from BTN_MOUSE) currently held */
+	uint32_t buttons_held;
+	/* Allocated at the first EV_ABS event of the device */
+	struct abs_state* abs;
+	/* The device has relative or absolute axes, kept across configs since it is a property of the device itself */
+	bool pointer_device;
+	/* Traffic classes (bit 1 << enum traffic_class) used by the current frame, its SYN_REPORT is sent through each
+	 * of them */
+	unsigned int frame_classes;
+	/* Relative motion dropped because the bulk socket was full, added to the next motion sent to the same client */
+	int32_t pending_motion[REL_CNT];
+	size_t pending_motion_client;
+	bool motion_pending;
+	/* The scan code of the current frame, held until the next event to drop it along with a repeat event */
+	struct input_event held_scan;
+	bool scan_held;
+	/* A repeat event was dropped in the current frame */
+	bool repeat_dropped;
+};
+
+static struct runtime_config* _Atomic current_config = NULL;
+static const char* config_path = NULL;
 
 static size_t current_client = 0;
 static pthread_mutex_t current_client_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int switch_modifier_state = 0;
 static int switch_key_state = 0;
-static const struct event_message switch_cleanup_messages[4] = {
-	{switchable_device, EV_KEY, switch_key, 0},
-	{switchable_device, 0, 0, 0},
-	{switchable_device, EV_KEY, switch_modifier, 0},
-	{switchable_device, 0, 0, 0},
-};
+
+static pthread_t postswitch_thread;
+static pthread_mutex_t postswitch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t postswitch_cond = PTHREAD_COND_INITIALIZER;
+/* Command of the last switch not run yet, older ones are dropped since only the last switch matters */
+static char* pending_postswitch_command = NULL;
+
+static bool capture_running = false;
+static atomic_size_t capture_dropped_frames;
+static int capture_fd = -1;
+static pthread_t capture_thread;
+static atomic_bool capture_stop_triggered = false;
+static atomic_ulong capture_rcu_seq;
 
 #ifdef ENCRYPTED_CONNECTION
 static uint8_t encryption_key[hydro_secretbox_KEYBYTES];
@@ -71,10 +376,499 @@ static int read_encryption_key(void) {
 }
 #endif
 
-struct libevdev* open_device(const struct device_config* dev) {
+/* Readers call rcu_read_lock before loading current_config and rcu_read_unlock once they are done with it. They only
+ * ever write their own counter so the event path never waits for a reload. */
+static void rcu_read_lock(atomic_ulong* rcu_seq) {
+	atomic_fetch_add(rcu_seq, 1);
+}
+
+static void rcu_read_unlock(atomic_ulong* rcu_seq) {
+	atomic_fetch_add_explicit(rcu_seq, 1, memory_order_release);
+}
+
+static void wait_for_reader(atomic_ulong* rcu_seq) {
+	const struct timespec poll_interval = {0, 1000000};
+	unsigned long seq = atomic_load(rcu_seq);
+	if (seq % 2 == 0)
+		return;
+	while (atomic_load(rcu_seq) == seq)
+		nanosleep(&poll_interval, NULL);
+}
+
+/* Waits until every reader that could have loaded old_config before it was replaced is done with it */
+static void wait_for_readers(const struct runtime_config* old_config) {
+	for (size_t i = 0; i < old_config->devices_len; i++) {
+		if (old_config->devices[i] != NULL)
+			wait_for_reader(&old_config->devices[i]->rcu_seq);
+	}
+	wait_for_reader(&capture_rcu_seq);
+}
+
+static void* array_append(void** array, size_t* array_len, size_t element_size) {
+	*array = realloc(*array, (*array_len + 1) * element_size);
+	assert(*array != NULL);
+	memset((uint8_t*)*array + *array_len * element_size, 0, element_size);
+	return (uint8_t*)*array + (*array_len)++ * element_size;
+}
+
+static void add_client_spec(struct runtime_config* config, int listen_mode, const char* address, uint16_t port,
+			    const char* postswitch_command) {
+	struct client_spec* spec = array_append((void**)&config->client_specs, &config->clients_len, sizeof(*spec));
+	spec->listen_mode = listen_mode;
+	spec->address = strdup_or_null(address);
+	spec->port = port;
+	spec->postswitch_command = strdup_or_null(postswitch_command);
+}
+
+static void add_device_spec(struct runtime_config* config, const char* path, uint32_t device_id) {
+	struct device_spec* spec = array_append((void**)&config->device_specs, &config->devices_len, sizeof(*spec));
+	spec->path = strdup_or_null(path);
+	spec->device_id = device_id;
+}
+
+static void free_config(struct runtime_config* config) {
+	size_t i;
+
+	for (i = 0; i < config->clients_len; i++) {
+		free(config->client_specs[i].address);
+		free(config->client_specs[i].postswitch_command);
+	}
+	free(config->client_specs);
+	free(config->clients);
+	free(config->all_clients);
+	for (i = 0; i < config->devices_len; i++)
+		free(config->device_specs[i].path);
+	free(config->device_specs);
+	free(config->devices);
+	free(config->passthrough_keys);
+	free(config->layers);
+	for (i = 0; i < config->remaps_len; i++)
+		free(config->remaps[i].to);
+	free(config->remaps);
+	for (i = 0; i < config->routes_len; i++)
+		free(config->routes[i].clients);
+	free(config->routes);
+	free(config->screens);
+	free(config->client_screens);
+	free(config->route_clients);
+	free(config->route_clients_len);
+	free(config->remap_table);
+	free(config->layer_table);
+	free(config);
+}
+
+/* Builds a runtime_config from the tables of controller.config.h, used when no configuration file is given */
+static struct runtime_config* load_default_config(void) {
+	struct runtime_config* config = calloc(1, sizeof(struct runtime_config));
+	size_t i;
+
+	assert(config != NULL);
+	for (i = 0; i < sizeof(clients) / sizeof(struct client_config); i++)
+		add_client_spec(config, clients[i].listen_mode, clients[i].address, clients[i].port,
+				clients[i].postswitch_command);
+	for (i = 0; i < sizeof(devices) / sizeof(struct device_config); i++)
+		add_device_spec(config, devices[i].device_path, devices[i].device_id);
+
+	config->switchable_device = switchable_device;
+	config->switch_modifier = switch_modifier;
+	config->switch_key = switch_key;
+	config->passthrough_client = passthrough_client;
+	for (i = 0; i < sizeof(passthrough_keys) / sizeof(unsigned int); i++)
+		*(unsigned int*)array_append((void**)&config->passthrough_keys, &config->passthrough_keys_len,
+					     sizeof(unsigned int)) = passthrough_keys[i];
+
+#ifdef KEY_REMAPPING
+	for (i = 0; i < sizeof(layers) / sizeof(struct layer_config); i++) {
+		struct layer* layer = array_append((void**)&config->layers, &config->layers_len, sizeof(*layer));
+		layer->device_id = layers[i].device_id;
+		layer->layer_key = layers[i].layer_key;
+		layer->layer = layers[i].layer;
+	}
+	for (i = 0; i < sizeof(remaps) / sizeof(struct remap_config); i++) {
+		struct remap* remap = array_append((void**)&config->remaps, &config->remaps_len, sizeof(*remap));
+		remap->device_id = remaps[i].device_id;
+		remap->client = remaps[i].client;
+		remap->layer = remaps[i].layer;
+		remap->from = remaps[i].from;
+		remap->mode = remaps[i].mode;
+		for (size_t j = 0; remaps[i].to[j] != (unsigned int)-1; j++)
+			*(unsigned int*)array_append((void**)&remap->to, &remap->to_len, sizeof(unsigned int)) =
+				remaps[i].to[j];
+	}
+#endif
+#ifdef DEVICE_ROUTING
+	for (i = 0; i < sizeof(routes) / sizeof(struct route_config); i++) {
+		struct route* route = array_append((void**)&config->routes, &config->routes_len, sizeof(*route));
+		route->device_id = routes[i].device_id;
+		for (size_t j = 0; routes[i].clients[j] != (size_t)-1; j++)
+			*(size_t*)array_append((void**)&route->clients, &route->clients_len, sizeof(size_t)) =
+				routes[i].clients[j];
+	}
+#endif
+#ifdef EDGE_SWITCHING
+	config->edge_switching_device = edge_switching_device;
+	for (i = 0; i < sizeof(screens) / sizeof(struct screen_config); i++) {
+		struct screen* screen = array_append((void**)&config->screens, &config->screens_len, sizeof(*screen));
+		screen->client = screens[i].client;
+		screen->size[0] = screens[i].width;
+		screen->size[1] = screens[i].height;
+		screen->neighbours[EDGE_LEFT] = screens[i].left;
+		screen->neighbours[EDGE_RIGHT] = screens[i].right;
+		screen->neighbours[EDGE_UP] = screens[i].up;
+		screen->neighbours[EDGE_DOWN] = screens[i].down;
+	}
+#endif
+	return config;
+}
+
+static int parse_key(const char* token, unsigned int* key) {
+	unsigned long number;
+	int code;
+	if (token == NULL)
+		return -1;
+	code = libevdev_event_code_from_name(EV_KEY, token);
+	if (code >= 0) {
+		*key = code;
+		return 0;
+	}
+	if (parse_number(token, KEY_MAX, &number) < 0)
+		return -1;
+	*key = number;
+	return 0;
+}
+
+static int parse_config_line(struct runtime_config* config, char* line) {
+	char* cursor = line;
+	char* directive = next_token(&cursor);
+	unsigned long number;
+	uint32_t device_id;
+
+	if (directive == NULL || directive[0] == '#')
+		return 0;
+
+	if (strcmp(directive, "client") == 0) {
+		/* client network ADDRESS PORT [POSTSWITCH_COMMAND...]
+		 * client unix PATH [POSTSWITCH_COMMAND...] */
+		char* mode = next_token(&cursor);
+		char* address = next_token(&cursor);
+		int listen_mode;
+		if (mode == NULL || address == NULL)
+			return -1;
+		if (strcmp(mode, "network") == 0) {
+			listen_mode = LISTEN_NETWORK;
+			if (parse_number(next_token(&cursor), UINT16_MAX, &number) < 0)
+				return -1;
+		} else if (strcmp(mode, "unix") == 0) {
+			listen_mode = LISTEN_UNIX;
+			number = 0;
+		} else {
+			return -1;
+		}
+		cursor += strspn(cursor, " \t");
+		add_client_spec(config, listen_mode, address, number, *cursor != '\0' ? cursor : NULL);
+	} else if (strcmp(directive, "device") == 0) {
+		/* device ID PATH */
+		char* path;
+		if (parse_device_id(next_token(&cursor), &device_id) < 0 || (path = next_token(&cursor)) == NULL)
+			return -1;
+		add_device_spec(config, path, device_id);
+	} else if (strcmp(directive, "switch") == 0) {
+		/* switch ID MODIFIER KEY */
+		if (parse_device_id(next_token(&cursor), &config->switchable_device) < 0 ||
+		    parse_key(next_token(&cursor), &config->switch_modifier) < 0 ||
+		    parse_key(next_token(&cursor), &config->switch_key) < 0)
+			return -1;
+	} else if (strcmp(directive, "passthrough") == 0) {
+		/* passthrough CLIENT KEY... */
+		char* token;
+		if (parse_number(next_token(&cursor), SIZE_MAX, &number) < 0)
+			return -1;
+		config->passthrough_client = number;
+		while ((token = next_token(&cursor)) != NULL) {
+			if (parse_key(token, array_append((void**)&config->passthrough_keys,
+							  &config->passthrough_keys_len, sizeof(unsigned int))) < 0)
+				return -1;
+		}
+	} else if (strcmp(directive, "layer") == 0) {
+		/* layer ID KEY LAYER */
+		struct layer* layer = array_append((void**)&config->layers, &config->layers_len, sizeof(*layer));
+		if (parse_device_id(next_token(&cursor), &layer->device_id) < 0 ||
+		    parse_key(next_token(&cursor), &layer->layer_key) < 0 ||
+		    parse_number(next_token(&cursor), UINT_MAX, &number) < 0)
+			return -1;
+		layer->layer = number;
+	} else if (strcmp(directive, "remap") == 0) {
+		/* remap ID CLIENT|* LAYER FROM chord|macro KEY... */
+		struct remap* remap = array_append((void**)&config->remaps, &config->remaps_len, sizeof(*remap));
+		char* token;
+		if (parse_device_id(next_token(&cursor), &remap->device_id) < 0)
+			return -1;
+		token = next_token(&cursor);
+		if (token != NULL && strcmp(token, "*") == 0)
+			remap->client = REMAP_ALL_CLIENTS;
+		else if (parse_number(token, SIZE_MAX, &number) == 0)
+			remap->client = number;
+		else
+			return -1;
+		if (parse_number(next_token(&cursor), UINT_MAX, &number) < 0 ||
+		    parse_key(next_token(&cursor), &remap->from) < 0)
+			return -1;
+		remap->layer = number;
+		token = next_token(&cursor);
+		if (token != NULL && strcmp(token, "chord") == 0)
+			remap->mode = REMAP_CHORD;
+		else if (token != NULL && strcmp(token, "macro") == 0)
+			remap->mode = REMAP_MACRO;
+		else
+			return -1;
+		while ((token = next_token(&cursor)) != NULL) {
+			unsigned int* to = array_append((void**)&remap->to, &remap->to_len, sizeof(unsigned int));
+			if (parse_key(token, to) < 0)
+				return -1;
+		}
+	} else if (strcmp(directive, "route") == 0) {
+		/* route ID CLIENT... */
+		struct route* route = array_append((void**)&config->routes, &config->routes_len, sizeof(*route));
+		char* token;
+		if (parse_device_id(next_token(&cursor), &route->device_id) < 0)
+			return -1;
+		while ((token = next_token(&cursor)) != NULL) {
+			if (parse_number(token, SIZE_MAX, &number) < 0)
+				return -1;
+			*(size_t*)array_append((void**)&route->clients, &route->clients_len, sizeof(size_t)) = number;
+		}
+	} else if (strcmp(directive, "edge_switching") == 0) {
+		/* edge_switching ID */
+		if (parse_device_id(next_token(&cursor), &config->edge_switching_device) < 0)
+			return -1;
+	} else if (strcmp(directive, "screen") == 0) {
+		/* screen CLIENT WIDTH HEIGHT LEFT|- RIGHT|- UP|- DOWN|- */
+		struct screen* screen = array_append((void**)&config->screens, &config->screens_len, sizeof(*screen));
+		if (parse_number(next_token(&cursor), SIZE_MAX, &number) < 0)
+			return -1;
+		screen->client = number;
+		for (size_t i = 0; i < 2; i++) {
+			if (parse_number(next_token(&cursor), INT32_MAX, &number) < 0)
+				return -1;
+			screen->size[i] = number;
+		}
+		for (size_t i = 0; i < 4; i++) {
+			char* token = next_token(&cursor);
+			if (token != NULL && strcmp(token, "-") == 0)
+				screen->neighbours[i] = NO_NEIGHBOUR;
+			else if (parse_number(token, SIZE_MAX, &number) == 0)
+				screen->neighbours[i] = number;
+			else
+				return -1;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static struct runtime_config* load_config_file(const char* path) {
+	struct runtime_config* config;
+	char* line = NULL;
+	size_t line_size = 0, line_number = 0;
+	FILE* file;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror("fopen");
+		return NULL;
+	}
+	config = calloc(1, sizeof(struct runtime_config));
+	assert(config != NULL);
+
+	while (getline(&line, &line_size, file) >= 0) {
+		line_number++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (parse_config_line(config, line) < 0) {
+			fprintf(stderr, "%s:%zu: Invalid line\n", path, line_number);
+			free(line);
+			fclose(file);
+			free_config(config);
+			return NULL;
+		}
+	}
+	free(line);
+	fclose(file);
+	return config;
+}
+
+static ssize_t find_device_index(const struct runtime_config* config, uint32_t device_id) {
+	for (size_t i = 0; i < config->devices_len; i++) {
+		if (config->device_specs[i].device_id == device_id)
+			return i;
+	}
+	return -1;
+}
+
+static int compile_routes(struct runtime_config* config) {
+	config->route_clients = calloc(config->devices_len * config->clients_len + 1, sizeof(size_t));
+	config->route_clients_len = calloc(config->devices_len + 1, sizeof(size_t));
+	assert(config->route_clients != NULL && config->route_clients_len != NULL);
+
+	for (size_t i = 0; i < config->routes_len; i++) {
+		const struct route* route = &config->routes[i];
+		ssize_t device_index = find_device_index(config, route->device_id);
+		if (device_index < 0 || config->route_clients_len[device_index] != 0 || route->clients_len == 0 ||
+		    route->clients_len > config->clients_len) {
+			fprintf(stderr, "compile_routes: invalid route %zu\n", i);
+			return -1;
+		}
+		for (size_t j = 0; j < route->clients_len; j++) {
+			if (route->clients[j] >= config->clients_len) {
+				fprintf(stderr, "compile_routes: invalid client in route %zu\n", i);
+				return -1;
+			}
+			config->route_clients[device_index * config->clients_len + j] = route->clients[j];
+		}
+		config->route_clients_len[device_index] = route->clients_len;
+	}
+	return 0;
+}
+
+static uint16_t* remap_row(const struct runtime_config* config, size_t device_index, size_t client_index,
+			   unsigned int layer) {
+	return &config->remap_table[((device_index * config->clients_len + client_index) * REMAP_LAYERS + layer) *
+				    KEY_CNT];
+}
+
+static int compile_remaps(struct runtime_config* config) {
+	size_t i, j;
+	ssize_t device_index;
+
+	if (config->layers_len == 0 && config->remaps_len == 0)
+		return 0;
+
+	if (config->remaps_len >= UINT16_MAX) {
+		fprintf(stderr, "compile_remaps: too many remaps\n");
+		return -1;
+	}
+	config->remap_table =
+		calloc(config->devices_len * config->clients_len * REMAP_LAYERS * KEY_CNT + 1, sizeof(uint16_t));
+	config->layer_table = calloc(config->devices_len * KEY_CNT + 1, sizeof(uint8_t));
+	assert(config->remap_table != NULL && config->layer_table != NULL);
+
+	for (i = 0; i < config->layers_len; i++) {
+		const struct layer* layer = &config->layers[i];
+		device_index = find_device_index(config, layer->device_id);
+		if (device_index < 0 || layer->layer_key >= KEY_CNT || layer->layer == 0 ||
+		    layer->layer >= REMAP_LAYERS) {
+			fprintf(stderr, "compile_remaps: invalid layer %zu\n", i);
+			return -1;
+		}
+		config->layer_table[device_index * KEY_CNT + layer->layer_key] = layer->layer;
+	}
+
+	for (i = 0; i < config->remaps_len; i++) {
+		const struct remap* remap = &config->remaps[i];
+		device_index = find_device_index(config, remap->device_id);
+		if (device_index < 0 || (remap->client >= config->clients_len && remap->client != REMAP_ALL_CLIENTS) ||
+		    remap->layer >= REMAP_LAYERS || remap->from >= KEY_CNT || remap->to_len == 0) {
+			fprintf(stderr, "compile_remaps: invalid remap %zu\n", i);
+			return -1;
+		}
+		for (j = 0; j < remap->to_len; j++) {
+			if (remap->to[j] >= KEY_CNT) {
+				fprintf(stderr, "compile_remaps: invalid key in remap %zu\n", i);
+				return -1;
+			}
+		}
+		for (j = 0; j < config->clients_len; j++) {
+			if (remap->client == REMAP_ALL_CLIENTS || remap->client == j)
+				remap_row(config, device_index, j, remap->layer)[remap->from] = i + 1;
+		}
+	}
+
+	/* Keys without a remap in a layer fall through to the layers below, this is resolved here once and for all so
+	 * the event path only does a single lookup */
+	for (i = 0; i < config->devices_len; i++) {
+		for (j = 0; j < config->clients_len; j++) {
+			for (unsigned int layer = 1; layer < REMAP_LAYERS; layer++) {
+				uint16_t* row = remap_row(config, i, j, layer);
+				const uint16_t* row_below = remap_row(config, i, j, layer - 1);
+				for (size_t key = 0; key < KEY_CNT; key++) {
+					if (row[key] == 0)
+						row[key] = row_below[key];
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int compile_screens(struct runtime_config* config) {
+	size_t i, j;
+
+	config->edge_device_index = -1;
+	if (config->screens_len == 0)
+		return 0;
+
+	config->edge_device_index = find_device_index(config, config->edge_switching_device);
+	if (config->edge_device_index < 0 || config->route_clients_len[config->edge_device_index] != 0) {
+		fprintf(stderr, "compile_screens: the edge switching device must exist and not be routed\n");
+		return -1;
+	}
+	config->client_screens = calloc(config->clients_len, sizeof(struct screen*));
+	assert(config->client_screens != NULL);
+
+	for (i = 0; i < config->screens_len; i++) {
+		const struct screen* screen = &config->screens[i];
+		if (screen->client >= config->clients_len || config->client_screens[screen->client] != NULL ||
+		    screen->size[0] <= 0 || screen->size[1] <= 0) {
+			fprintf(stderr, "compile_screens: invalid screen %zu\n", i);
+			return -1;
+		}
+		config->client_screens[screen->client] = screen;
+	}
+	for (i = 0; i < config->screens_len; i++) {
+		for (j = 0; j < 4; j++) {
+			size_t neighbour = config->screens[i].neighbours[j];
+			if (neighbour != NO_NEIGHBOUR &&
+			    (neighbour >= config->clients_len || config->client_screens[neighbour] == NULL)) {
+				fprintf(stderr, "compile_screens: invalid neighbour in screen %zu\n", i);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Validates config and builds the flat tables used by the event path */
+static int compile_config(struct runtime_config* config) {
+	if (config->clients_len == 0) {
+		fprintf(stderr, "compile_config: at least one client is needed\n");
+		return -1;
+	}
+	if (config->passthrough_keys_len != 0 && config->passthrough_client >= config->clients_len) {
+		fprintf(stderr, "compile_config: invalid passthrough client\n");
+		return -1;
+	}
+	for (size_t i = 0; i < config->passthrough_keys_len; i++) {
+		if (config->passthrough_keys[i] >= KEY_CNT) {
+			fprintf(stderr, "compile_config: invalid passthrough key\n");
+			return -1;
+		}
+		config->passthrough_table[config->passthrough_keys[i]] = true;
+	}
+
+	config->all_clients = calloc(config->clients_len, sizeof(size_t));
+	assert(config->all_clients != NULL);
+	for (size_t i = 0; i < config->clients_len; i++)
+		config->all_clients[i] = i;
+
+	if (compile_routes(config) < 0 || compile_remaps(config) < 0 || compile_screens(config) < 0)
+		return -1;
+	return 0;
+}
+
+struct libevdev* open_device(const char* device_path) {
 	struct libevdev* dev_libev;
 	int err;
-	int fd = open(dev->device_path, O_RDWR);
+	int fd = open(device_path, O_RDWR);
 	if (fd < 0) {
 		perror("open");
 		return NULL;
@@ -102,7 +896,8 @@ struct libevdev* open_device(const struct device_config* dev) {
 	return dev_libev;
 }
 
-static int open_client(const struct client_config* cli, struct sockaddr** addr_out) {
+/* The priority socket of a client listens on the next port or on its path with the "-priority" suffix */
+static int open_client(const struct client_spec* cli, bool priority, struct sockaddr** addr_out) {
 	int fd = -1;
 	if (cli->listen_mode == LISTEN_NETWORK) {
 		struct sockaddr_in* socket_name;
@@ -113,13 +908,26 @@ static int open_client(const struct client_config* cli, struct sockaddr** addr_o
 			return -1;
 		}
 
+		if (priority) {
+			/* Expedited Forwarding for the network and, for the local queueing discipline, the highest
+			 * priority unprivileged processes can use */
+			int tos = IPTOS_DSCP_EF, socket_priority = 6;
+			if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0 ||
+			    setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &socket_priority, sizeof(socket_priority)) < 0) {
+				perror("setsockopt");
+				close(fd);
+				return -1;
+			}
+		}
+
 		socket_name = malloc(sizeof(struct sockaddr_in));
 		socket_name->sin_family = AF_INET;
-		socket_name->sin_port = htons(cli->port);
+		socket_name->sin_port = htons(cli->port + priority);
 
 		if (inet_aton(cli->address, &socket_name->sin_addr) == 0) {
 			fprintf(stderr, "inet_aton: Invalid address\n");
 			free(socket_name);
+			close(fd);
 			return -1;
 		}
 
@@ -133,9 +941,10 @@ static int open_client(const struct client_config* cli, struct sockaddr** addr_o
 			return -1;
 		}
 
-		socket_name = malloc(sizeof(struct sockaddr_un));
+		socket_name = calloc(1, sizeof(struct sockaddr_un));
 		socket_name->sun_family = AF_UNIX;
-		strncpy(socket_name->sun_path, cli->address, sizeof(socket_name->sun_path) - 1);
+		snprintf(socket_name->sun_path, sizeof(socket_name->sun_path), "%s%s", cli->address,
+			 priority ? "-priority" : "");
 		*addr_out = (struct sockaddr*)socket_name;
 	} else {
 		/* WHAT HAVE YOU DONE ??? */
@@ -144,10 +953,57 @@ static int open_client(const struct client_config* cli, struct sockaddr** addr_o
 	return fd;
 }
 
-static int send_message(size_t client_index, const struct event_message* message_to_send) {
-	const struct client_config* cli = &clients[client_index];
-	ssize_t sent_bytes;
-	size_t addrlen;
+/* Sends packet to every client in client_indexes in as few syscalls as possible. Client sockets aren't connected so
+ * the socket of any client can send to every other client of the same listen_mode.
+ * Returns -2 if a TRAFFIC_DROPPABLE packet was dropped for some clients. */
+static int send_packet(const struct runtime_config* config, const size_t* client_indexes, size_t clients_count,
+		       enum traffic_class traffic_class, void* packet, size_t packet_len) {
+	struct mmsghdr messages[clients_count];
+	struct iovec packet_iov = {packet, packet_len};
+	const int listen_modes[] = {LISTEN_NETWORK, LISTEN_UNIX};
+	int flags = traffic_class == TRAFFIC_DROPPABLE ? MSG_DONTWAIT : 0;
+	int ret = 0;
+
+	for (size_t i = 0; i < sizeof(listen_modes) / sizeof(listen_modes[0]); i++) {
+		size_t messages_len = 0, sent_messages = 0;
+		int fd = -1;
+
+		for (size_t j = 0; j < clients_count; j++) {
+			const struct client* cli = config->clients[client_indexes[j]];
+			if (cli->listen_mode != listen_modes[i])
+				continue;
+
+			bool priority = traffic_class == TRAFFIC_PRIORITY && cli->priority_fd >= 0;
+			memset(&messages[messages_len], 0, sizeof(struct mmsghdr));
+			messages[messages_len].msg_hdr.msg_name = priority ? cli->priority_addr : cli->addr;
+			messages[messages_len].msg_hdr.msg_namelen = cli->addrlen;
+			messages[messages_len].msg_hdr.msg_iov = &packet_iov;
+			messages[messages_len].msg_hdr.msg_iovlen = 1;
+			messages_len++;
+			fd = priority ? cli->priority_fd : cli->fd;
+		}
+
+		while (sent_messages < messages_len) {
+			int sent = sendmmsg(fd, &messages[sent_messages], messages_len - sent_messages, flags);
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && (flags & MSG_DONTWAIT)) {
+				/* Skips the client whose queue is full, the next ones may still have room */
+				ret = ret < 0 ? ret : -2;
+				sent = 1;
+			} else if (sent < 0) {
+				/* A client that is down mustn't prevent the next ones from receiving the packet */
+				perror("sendmmsg");
+				ret = -1;
+				sent = 1;
+			}
+			sent_messages += sent;
+		}
+	}
+	return ret;
+}
+
+/* The message is encoded and encrypted once whatever the number of clients it is sent to */
+static int send_message(const struct runtime_config* config, const size_t* client_indexes, size_t clients_count,
+			enum traffic_class traffic_class, const struct event_message* message_to_send) {
 	struct event_message message_to_send_be;
 
 	message_to_send_be.device_id = ntohl(message_to_send->device_id);
@@ -166,126 +1022,1338 @@ static int send_message(size_t client_index, const struct event_message* message
 	void* final_packet = &message_to_send_be;
 #endif
 
-	if (cli->listen_mode == LISTEN_NETWORK)
-		addrlen = sizeof(struct sockaddr_in);
-	else if (cli->listen_mode == LISTEN_UNIX)
-		addrlen = sizeof(struct sockaddr_un);
-	else
-		abort();
+	return send_packet(config, client_indexes, clients_count, traffic_class, final_packet, message_len);
+}
 
-	sent_bytes =
-		sendto(clients_fd[client_index], final_packet, message_len, 0, clients_addr[client_index], addrlen);
-	if (sent_bytes != message_len) {
-		perror("sendto");
-		return -1;
+/* Returns true if the event was a layer key and must not be sent */
+static bool update_layer_state(struct device_state* state, const struct input_event* ev) {
+	const struct runtime_config* config = state->config;
+	unsigned int layer;
+
+	if (config->layer_table == NULL || ev->type != EV_KEY || ev->code >= KEY_CNT)
+		return false;
+	layer = config->layer_table[state->device_index * KEY_CNT + ev->code];
+	if (layer == 0)
+		return false;
+
+	if (ev->value == 1)
+		state->layer_state |= 1u << layer;
+	else if (ev->value == 0)
+		state->layer_state &= ~(1u << layer);
+	return true;
+}
+
+/* Records in keys (see device_state) that message pressed or released its key on client_indexes. The clients a
+ * released key wasn't pressed on (before a reload or a switch) are removed from client_indexes, returns the number of
+ * clients left. */
+static size_t track_key(uint64_t* keys, size_t* client_indexes, size_t clients_count,
+			const struct event_message* message) {
+	uint64_t bit = 1ull << (message->event_code % 64);
+	size_t kept = 0;
+
+	for (size_t i = 0; i < clients_count; i++) {
+		uint64_t* word = &keys[client_indexes[i] * KEY_WORDS + message->event_code / 64];
+		if (message->event_value == 0 && !(*word & bit))
+			continue;
+		*word = message->event_value == 0 ? *word & ~bit : *word | bit;
+		client_indexes[kept++] = client_indexes[i];
 	}
-	return 0;
+	return kept;
 }
 
-static void switch_client(void) {
-	int ret = pthread_mutex_lock(&current_client_lock);
-	if (ret != 0) {
-		fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(ret));
+static void send_remapped_message(struct device_state* state, uint16_t remap_index, const size_t* client_indexes,
+				  size_t clients_count, const struct event_message* message) {
+	const struct runtime_config* config = state->config;
+	const struct remap* remap = &config->remaps[remap_index - 1];
+	struct event_message remapped_message = {message->device_id, EV_KEY, 0, message->event_value};
+	struct event_message sync_message = {message->device_id, 0, 0, 0};
+	size_t i;
+
+	if (remap->mode == REMAP_CHORD) {
+		size_t tracked_indexes[clients_count];
+		if (message->event_value == 1) {
+			for (i = 0; i < remap->to_len; i++) {
+				remapped_message.event_code = remap->to[i];
+				memcpy(tracked_indexes, client_indexes, clients_count * sizeof(size_t));
+				track_key(state->chords_down, tracked_indexes, clients_count, &remapped_message);
+				send_message(config, client_indexes, clients_count, TRAFFIC_PRIORITY,
+					     &remapped_message);
+			}
+		} else if (message->event_value == 0) {
+			for (i = remap->to_len; i-- > 0;) {
+				remapped_message.event_code = remap->to[i];
+				memcpy(tracked_indexes, client_indexes, clients_count * sizeof(size_t));
+				track_key(state->chords_down, tracked_indexes, clients_count, &remapped_message);
+				send_message(config, client_indexes, clients_count, TRAFFIC_PRIORITY,
+					     &remapped_message);
+			}
+		}
+	} else if (remap->mode == REMAP_MACRO) {
+		if (message->event_value != 1)
+			return;
+		for (i = 0; i < remap->to_len; i++) {
+			remapped_message.event_code = remap->to[i];
+			remapped_message.event_value = 1;
+			send_message(config, client_indexes, clients_count, TRAFFIC_PRIORITY, &remapped_message);
+			send_message(config, client_indexes, clients_count, TRAFFIC_PRIORITY, &sync_message);
+			remapped_message.event_value = 0;
+			send_message(config, client_indexes, clients_count, TRAFFIC_PRIORITY, &remapped_message);
+			send_message(config, client_indexes, clients_count, TRAFFIC_PRIORITY, &sync_message);
+		}
+	} else {
 		abort();
 	}
+}
 
-	current_client = (current_client + 1) % clients_len;
-	switch_modifier_state = 0;
-	switch_key_state = 0;
-	for (size_t i = 0; i < clients_len; i++) {
-		for (size_t j = 0; j < sizeof(switch_cleanup_messages) / sizeof(struct event_message); j++) {
-			send_message(i, &switch_cleanup_messages[j]);
+static void send_device_message(struct device_state* state, const size_t* client_indexes, size_t clients_count,
+				enum traffic_class traffic_class, const struct event_message* message) {
+	const struct runtime_config* config = state->config;
+	bool key_message = message->event_type == EV_KEY && message->event_code < KEY_CNT;
+	size_t tracked_indexes[clients_count];
+
+	if (config->remap_table != NULL && key_message) {
+		uint16_t remap_indexes[clients_count];
+		size_t group[clients_count];
+		unsigned int layer = 0;
+		size_t i, j, group_len;
+
+		if (state->layer_state != 0)
+			layer = (sizeof(state->layer_state) * 8 - 1) - __builtin_clz(state->layer_state);
+		for (i = 0; i < clients_count; i++) {
+			uint16_t* pressed = &state->remap_pressed[client_indexes[i] * KEY_CNT + message->event_code];
+			if (message->event_value == 1)
+				*pressed = remap_row(config, state->device_index, client_indexes[i],
+						     layer)[message->event_code];
+			remap_indexes[i] = *pressed;
+			if (message->event_value == 0)
+				*pressed = 0;
 		}
-	}
 
-	if (clients[current_client].postswitch_command) {
-		ret = system(clients[current_client].postswitch_command);
-		if (ret != 0)
-			fprintf(stderr, "system: returned %d\n", ret);
+		/* Clients sharing the same remap are sent the same messages, group them so every message is still only
+		 * encrypted once when mirroring */
+		for (i = 0; i < clients_count; i++) {
+			if (remap_indexes[i] == UINT16_MAX)
+				continue;
+			for (j = i + 1, group_len = 0; j < clients_count; j++) {
+				if (remap_indexes[j] == remap_indexes[i]) {
+					group[group_len++] = client_indexes[j];
+					remap_indexes[j] = UINT16_MAX;
+				}
+			}
+			group[group_len++] = client_indexes[i];
+			if (remap_indexes[i] != 0) {
+				send_remapped_message(state, remap_indexes[i], group, group_len, message);
+				continue;
+			}
+			group_len = track_key(state->keys_down, group, group_len, message);
+			if (group_len != 0)
+				send_message(config, group, group_len, traffic_class, message);
+		}
+		return;
 	}
-
-	ret = pthread_mutex_unlock(&current_client_lock);
-	if (ret != 0) {
-		fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(ret));
-		abort();
+	if (key_message) {
+		memcpy(tracked_indexes, client_indexes, clients_count * sizeof(size_t));
+		clients_count = track_key(state->keys_down, tracked_indexes, clients_count, message);
+		client_indexes = tracked_indexes;
+		if (clients_count == 0)
+			return;
 	}
+	send_message(config, client_indexes, clients_count, traffic_class, message);
 }
 
-static void* handle_one_device_thread(void* device_index_as_void) {
-	size_t device_index = (size_t)device_index_as_void;
-#ifdef DONT_USE_LIBEVDEV_FOR_READING
-	int fd = libevdev_get_fd(devices_libev[device_index]);
-#endif
+/* Switching monitor inputs can take about a second, postswitch commands are thus run by postswitch_thread so the
+ * events following a switch aren't delayed */
+static void* postswitch_thread_main(void* unused) {
+	(void)unused;
 
+	for (;;) {
+		char* command;
+		int ret;
+
+		pthread_mutex_lock(&postswitch_lock);
+		while (pending_postswitch_command == NULL)
+			pthread_cond_wait(&postswitch_cond, &postswitch_lock);
+		command = pending_postswitch_command;
+		pending_postswitch_command = NULL;
+		pthread_mutex_unlock(&postswitch_lock);
+
+		ret = system(command);
+		if (ret != 0)
+			fprintf(stderr, "system: returned %d\n", ret);
+		free(command);
+	}
+	return NULL;
+}
+
+static void queue_postswitch_command(const char* command) {
+	if (command == NULL)
+		return;
+	pthread_mutex_lock(&postswitch_lock);
+	free(pending_postswitch_command);
+	pending_postswitch_command = strdup_or_null(command);
+	pthread_cond_signal(&postswitch_cond);
+	pthread_mutex_unlock(&postswitch_lock);
+}
+
+static void switch_client(void) {
+	int ret = pthread_mutex_lock(&current_client_lock);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(ret));
+		abort();
+	}
+
+	/* Loaded under the lock so a concurrent reload can't leave current_client past the end of its clients */
+	const struct runtime_config* config = atomic_load(&current_config);
+	const struct event_message switch_cleanup_messages[4] = {
+		{config->switchable_device, EV_KEY, config->switch_key, 0},
+		{config->switchable_device, 0, 0, 0},
+		{config->switchable_device, EV_KEY, config->switch_modifier, 0},
+		{config->switchable_device, 0, 0, 0},
+	};
+
+	current_client = (current_client + 1) % config->clients_len;
+	switch_modifier_state = 0;
+	switch_key_state = 0;
+	for (size_t i = 0; i < sizeof(switch_cleanup_messages) / sizeof(struct event_message); i++) {
+		send_message(config, config->all_clients, config->clients_len, TRAFFIC_PRIORITY,
+			     &switch_cleanup_messages[i]);
+	}
+
+	queue_postswitch_command(config->client_specs[current_client].postswitch_command);
+
+	ret = pthread_mutex_unlock(&current_client_lock);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(ret));
+		abort();
+	}
+}
+
+/* Switches from client_index to the neighbour of its screen the cursor went to through edge. position is the position
+ * the cursor would have had on the axis crossing the edge if the screen was larger. */
+static void switch_client_through_edge(struct device_state* state, size_t client_index, enum edge edge,
+				       int32_t position) {
+	const struct runtime_config* config = state->config;
+	const struct screen* screen = config->client_screens[client_index];
+	size_t neighbour = screen->neighbours[edge];
+	const struct screen* next_screen = config->client_screens[neighbour];
+	struct cursor* cursor = &state->cursors[client_index];
+	struct cursor* next_cursor = &state->cursors[neighbour];
+	uint32_t device_id = config->device_specs[state->device_index].device_id;
+	unsigned int axis = edge / 2, other_axis = 1 - axis;
+	int32_t edge_position = edge % 2 == 0 ? 0 : screen->size[axis] - 1;
+	bool switched = false;
+	int ret;
+
+	/* The previous client gets the motion up to the edge and the end of its frame */
+	const struct event_message message = {device_id, EV_REL, axis == 0 ? REL_X : REL_Y,
+					      edge_position - cursor->position[axis]};
+	const struct event_message sync_message = {device_id, 0, 0, 0};
+	if (message.event_value != 0)
+		send_message(config, &client_index, 1, TRAFFIC_BULK, &message);
+	send_message(config, &client_index, 1, TRAFFIC_BULK, &sync_message);
+	cursor->position[axis] = edge_position;
+
+	ret = pthread_mutex_lock(&current_client_lock);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(ret));
+		abort();
+	}
+	/* The switch chord or a reload may have changed current_client since the event was read */
+	if (current_client == client_index && neighbour < atomic_load(&current_config)->clients_len) {
+		current_client = neighbour;
+		queue_postswitch_command(config->client_specs[neighbour].postswitch_command);
+		switched = true;
+	}
+	ret = pthread_mutex_unlock(&current_client_lock);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(ret));
+		abort();
+	}
+	if (!switched)
+		return;
+
+	/* The cursor enters the neighbour through the opposite edge, as far past it as it went past the edge of the
+	 * previous screen, and at the same relative position along it */
+	if (edge % 2 == 0)
+		next_cursor->position[axis] = next_screen->size[axis] + position;
+	else
+		next_cursor->position[axis] = position - screen->size[axis];
+	if (next_cursor->position[axis] < 0)
+		next_cursor->position[axis] = 0;
+	if (next_cursor->position[axis] >= next_screen->size[axis])
+		next_cursor->position[axis] = next_screen->size[axis] - 1;
+	next_cursor->position[other_axis] =
+		(int64_t)cursor->position[other_axis] * next_screen->size[other_axis] / screen->size[other_axis];
+
+	/* The real cursor of the neighbour is sent to the top left corner then to the entry position, the rest of the
+	 * current frame follows */
+	const struct event_message entry_messages[] = {
+		{device_id, EV_REL, REL_X, -next_screen->size[0]},
+		{device_id, EV_REL, REL_Y, -next_screen->size[1]},
+		{device_id, 0, 0, 0},
+		{device_id, EV_REL, REL_X, next_cursor->position[0]},
+		{device_id, EV_REL, REL_Y, next_cursor->position[1]},
+	};
+	for (size_t i = 0; i < sizeof(entry_messages) / sizeof(struct event_message); i++)
+		send_message(config, &neighbour, 1, TRAFFIC_BULK, &entry_messages[i]);
+}
+
+/* Integrates the motion of the edge switching device into the virtual cursor of client_index, returns true if the
+ * event made the cursor go to another client and was thus already sent */
+static bool move_cursor(struct device_state* state, size_t client_index, const struct input_event* ev) {
+	const struct runtime_config* config = state->config;
+	const struct screen* screen = config->client_screens[client_index];
+	unsigned int axis;
+	int32_t position;
+	enum edge edge;
+
+	if (ev->type == EV_KEY && ev->code >= BTN_MOUSE && ev->code < BTN_MOUSE + 32) {
+		if (ev->value == 1)
+			state->buttons_held |= 1u << (ev->code - BTN_MOUSE);
+		else if (ev->value == 0)
+			state->buttons_held &= ~(1u << (ev->code - BTN_MOUSE));
+		return false;
+	}
+	if (ev->type != EV_REL || (ev->code != REL_X && ev->code != REL_Y) || screen == NULL)
+		return false;
+
+	axis = ev->code == REL_X ? 0 : 1;
+	position = state->cursors[client_index].position[axis] + ev->value;
+	if (position >= 0 && position < screen->size[axis]) {
+		state->cursors[client_index].position[axis] = position;
+		return false;
+	}
+
+	edge = axis * 2 + (position < 0 ? 0 : 1);
+	if (screen->neighbours[edge] == NO_NEIGHBOUR || state->buttons_held != 0) {
+		state->cursors[client_index].position[axis] = position < 0 ? 0 : screen->size[axis] - 1;
+		return false;
+	}
+	switch_client_through_edge(state, client_index, edge, position);
+	return true;
+}
+
+static void free_device_state(struct device_state* state) {
+	free(state->keys_down);
+	state->keys_down = NULL;
+	free(state->chords_down);
+	state->chords_down = NULL;
+	free(state->key_clients);
+	state->key_clients = NULL;
+	state->key_clients_len = 0;
+	free(state->remap_pressed);
+	state->remap_pressed = NULL;
+	free(state->cursors);
+	state->cursors = NULL;
+	free(state->abs);
+	state->abs = NULL;
+}
+
+/* Sends to client_index of config the release of every key in keys (a KEY_WORDS bitmap) */
+static void release_keys(const struct runtime_config* config, size_t client_index, uint32_t device_id,
+			 const uint64_t* keys) {
+	const struct event_message sync_message = {device_id, 0, 0, 0};
+	bool released = false;
+
+	for (unsigned int key = 0; key < KEY_CNT; key++) {
+		struct event_message message = {device_id, EV_KEY, key, 0};
+		if (!(keys[key / 64] & (1ull << (key % 64))))
+			continue;
+		send_message(config, &client_index, 1, TRAFFIC_PRIORITY, &message);
+		released = true;
+	}
+	if (released)
+		send_message(config, &client_index, 1, TRAFFIC_PRIORITY, &sync_message);
+}
+
+/* Moves the keys held on the clients of the previous config of state to the same clients in config. Keys sent by
+ * chords are released since remap_pressed is reset, so are all the keys if the id of the device changed or if the
+ * device isn't part of config (device_index is -1, keys_down may then be NULL). The keys of clients config doesn't
+ * have can't be released anymore. Clients are matched by address, a new client allocated where
+ * a removed one was can only get releases of keys it doesn't have, which controlled ignores. */
+static void carry_held_keys(struct device_state* state, const struct runtime_config* config, ssize_t device_index,
+			    uint64_t* keys_down) {
+	uint32_t device_id = device_index >= 0 ? config->device_specs[device_index].device_id : state->device_id;
+	size_t followed_client = current_client < config->clients_len ? current_client : 0;
+
+	for (size_t i = 0; i < state->key_clients_len; i++) {
+		const uint64_t* old_keys_down = &state->keys_down[i * KEY_WORDS];
+		size_t j;
+		for (j = 0; j < config->clients_len && config->clients[j] != state->key_clients[i]; j++)
+			;
+		if (j == config->clients_len)
+			continue;
+		if (i == state->followed_client)
+			followed_client = j;
+		release_keys(config, j, state->device_id, &state->chords_down[i * KEY_WORDS]);
+		if (device_index < 0 || device_id != state->device_id)
+			release_keys(config, j, state->device_id, old_keys_down);
+		else
+			memcpy(&keys_down[j * KEY_WORDS], old_keys_down, KEY_WORDS * sizeof(uint64_t));
+	}
+	state->followed_client = followed_client;
+}
+
+/* Releases the keys the device holds on client_index, passthrough keys excepted since they don't follow
+ * current_client */
+static void release_followed_keys(struct device_state* state, size_t client_index) {
+	const struct runtime_config* config = state->config;
+	uint64_t* keys_down = &state->keys_down[client_index * KEY_WORDS];
+	uint64_t* chords_down = &state->chords_down[client_index * KEY_WORDS];
+	uint64_t keys[KEY_WORDS];
+
+	memcpy(keys, chords_down, sizeof(keys));
+	memset(chords_down, 0, sizeof(keys));
+	for (unsigned int key = 0; key < KEY_CNT; key++) {
+		uint64_t bit = 1ull << (key % 64);
+		if ((keys_down[key / 64] & bit) && !config->passthrough_table[key]) {
+			keys[key / 64] |= bit;
+			keys_down[key / 64] &= ~bit;
+		}
+	}
+	release_keys(config, client_index, state->device_id, keys);
+}
+
+/* Releases the keys held by a device thread that stops, on the clients of the current config. It's the cleanup handler
+ * of the thread since a reload removing the device cancels it, the main thread then waits in pthread_join and can't
+ * free the current config meanwhile, otherwise the caller must be in a read-side critical section. */
+static void stop_device_state(void* state_as_void) {
+	struct device_state* state = state_as_void;
+
+	carry_held_keys(state, atomic_load(&current_config), -1, NULL);
+	free_device_state(state);
+}
+
+/* Makes state follow config, device_index is -1 if the device isn't part of config anymore */
+static void update_device_state(struct device_state* state, const struct runtime_config* config,
+				ssize_t device_index) {
+	uint64_t* keys_down = calloc(config->clients_len * KEY_WORDS + 1, sizeof(uint64_t));
+	assert(keys_down != NULL);
+	carry_held_keys(state, config, device_index, keys_down);
+	free_device_state(state);
+	state->keys_down = keys_down;
+	state->chords_down = calloc(config->clients_len * KEY_WORDS + 1, sizeof(uint64_t));
+	state->key_clients = calloc(config->clients_len + 1, sizeof(struct client*));
+	assert(state->chords_down != NULL && state->key_clients != NULL);
+	memcpy(state->key_clients, config->clients, config->clients_len * sizeof(struct client*));
+	state->key_clients_len = config->clients_len;
+	if (device_index >= 0)
+		state->device_id = config->device_specs[device_index].device_id;
+	state->config = config;
+	state->config_generation = config->generation;
+	state->device_index = device_index;
+	state->layer_state = 0;
+	state->frame_classes = 0;
+	memset(state->pending_motion, 0, sizeof(state->pending_motion));
+	state->motion_pending = false;
+	state->scan_held = false;
+	state->repeat_dropped = false;
+	if (config->remap_table != NULL) {
+		state->remap_pressed = calloc(config->clients_len * KEY_CNT, sizeof(uint16_t));
+		assert(state->remap_pressed != NULL);
+	}
+	/* Cursors start in the middle of the screens, they catch up with the real ones whenever they are pushed against
+	 * an edge */
+	state->buttons_held = 0;
+	if (device_index >= 0 && device_index == config->edge_device_index) {
+		state->cursors = calloc(config->clients_len, sizeof(struct cursor));
+		assert(state->cursors != NULL);
+		for (size_t i = 0; i < config->clients_len; i++) {
+			if (config->client_screens[i] != NULL) {
+				state->cursors[i].position[0] = config->client_screens[i]->size[0] / 2;
+				state->cursors[i].position[1] = config->client_screens[i]->size[1] / 2;
+			}
+		}
+	}
+}
+
+static void forget_abs_values(struct abs_state* abs, const size_t* client_indexes, size_t clients_count) {
+	abs->client_index = client_indexes[0];
+	abs->clients_count = clients_count;
+	for (size_t i = 0; i < ABS_CNT; i++)
+		abs->values[i] = ABS_UNKNOWN;
+	for (size_t i = 0; i < ABS_DEDUP_SLOTS; i++) {
+		for (size_t j = 0; j < ABS_CNT - ABS_MT_FIRST; j++)
+			abs->mt_values[i][j] = ABS_UNKNOWN;
+	}
+	abs->sent_slot = -1;
+	abs->frame_empty = true;
+}
+
+/* Returns true if the event wouldn't change the state of the destination and must not be sent :
+ * - absolute values equal to the last ones sent
+ * - slot selections, the slot is only selected on the destination before a multitouch value that is actually sent
+ * - frames left empty by the above
+ */
+static bool filter_abs_event(struct device_state* state, const size_t* client_indexes, size_t clients_count,
+			     const struct input_event* ev) {
+	struct abs_state* abs = state->abs;
+	int32_t* value = NULL;
+
+	if (abs == NULL) {
+		if (ev->type != EV_ABS)
+			return false;
+		abs = state->abs = malloc(sizeof(struct abs_state));
+		assert(abs != NULL);
+		abs->slot = -1;
+		forget_abs_values(abs, client_indexes, clients_count);
+	} else if (abs->client_index != client_indexes[0] || abs->clients_count != clients_count) {
+		forget_abs_values(abs, client_indexes, clients_count);
+	}
+
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+		bool frame_empty = abs->frame_empty;
+		abs->frame_empty = true;
+		return frame_empty;
+	}
+	if (ev->type != EV_ABS || ev->code >= ABS_CNT) {
+		abs->frame_empty = false;
+		return false;
+	}
+
+	if (ev->code == ABS_MT_SLOT) {
+		abs->slot = ev->value;
+		return true;
+	} else if (ev->code >= ABS_MT_FIRST) {
+		if (abs->slot >= 0 && abs->slot < ABS_DEDUP_SLOTS)
+			value = &abs->mt_values[abs->slot][ev->code - ABS_MT_FIRST];
+		if (value != NULL && *value == ev->value)
+			return true;
+		if (abs->slot >= 0 && abs->sent_slot != abs->slot) {
+			struct event_message slot_message = {state->config->device_specs[state->device_index].device_id,
+							     EV_ABS, ABS_MT_SLOT, abs->slot};
+			send_message(state->config, client_indexes, clients_count, TRAFFIC_BULK, &slot_message);
+			abs->sent_slot = abs->slot;
+		}
+	} else {
+		value = &abs->values[ev->code];
+		if (*value == ev->value)
+			return true;
+	}
+
+	if (value != NULL)
+		*value = ev->value;
+	abs->frame_empty = false;
+	return false;
+}
+
+/* Key events go through the priority socket so they never wait behind motion. Those of devices with relative or
+ * absolute axes (buttons, touches and tools of mice, touchpads and tablets) stay in the bulk path with the motion they
+ * belong to, controlled reads the priority socket first and a click would otherwise land where the pointer was some
+ * frames earlier. Relative motion is dropped and coalesced when the bulk socket is full, this is only done for a single
+ * destination since a partial fan-out would have to be tracked per client. */
+static enum traffic_class event_traffic_class(const struct device_state* state, const struct input_event* ev,
+					      size_t destinations_len) {
+	if (ev->type == EV_KEY || (ev->type == EV_MSC && ev->code == MSC_SCAN))
+		return state->pointer_device ? TRAFFIC_BULK : TRAFFIC_PRIORITY;
+	if (ev->type == EV_REL && ev->code < REL_CNT && destinations_len == 1)
+		return TRAFFIC_DROPPABLE;
+	return TRAFFIC_BULK;
+}
+
+/* Returns true if some motion is still pending */
+static bool send_pending_motion(struct device_state* state, size_t client_index, enum traffic_class traffic_class) {
+	uint32_t device_id = state->config->device_specs[state->device_index].device_id;
+	bool motion_pending = false;
+
+	for (unsigned int code = 0; code < REL_CNT; code++) {
+		struct event_message message = {device_id, EV_REL, code, state->pending_motion[code]};
+		if (message.event_value == 0)
+			continue;
+		if (send_message(state->config, &client_index, 1, traffic_class, &message) == 0)
+			state->pending_motion[code] = 0;
+		else
+			motion_pending = true;
+	}
+	return motion_pending;
+}
+
+/* Sends a relative motion event or the SYN_REPORT of a frame that only contains motion, adding the motion that
+ * couldn't be sent before */
+static void send_motion(struct device_state* state, size_t client_index, struct event_message* message) {
+	if (state->pending_motion_client != client_index) {
+		memset(state->pending_motion, 0, sizeof(state->pending_motion));
+		state->pending_motion_client = client_index;
+		state->motion_pending = false;
+	}
+
+	if (message->event_type == EV_REL) {
+		message->event_value += state->pending_motion[message->event_code];
+		state->pending_motion[message->event_code] = 0;
+		if (send_message(state->config, &client_index, 1, TRAFFIC_DROPPABLE, message) == -2) {
+			state->pending_motion[message->event_code] = message->event_value;
+			state->motion_pending = true;
+		}
+		return;
+	}
+
+	if (state->motion_pending)
+		state->motion_pending = send_pending_motion(state, client_index, TRAFFIC_DROPPABLE);
+	/* A dropped SYN_REPORT merges the frame with the next one */
+	send_message(state->config, &client_index, 1, TRAFFIC_DROPPABLE, message);
+}
+
+/* Sends the SYN_REPORT ending the current frame through every traffic class the frame used */
+static void end_frame(struct device_state* state, const size_t* destinations, size_t destinations_len,
+		      struct event_message* message) {
+	unsigned int frame_classes = state->frame_classes != 0 ? state->frame_classes : 1u << TRAFFIC_BULK;
+
+	state->frame_classes = 0;
+	if (frame_classes & (1u << TRAFFIC_PRIORITY))
+		send_message(state->config, destinations, destinations_len, TRAFFIC_PRIORITY, message);
+	if (frame_classes & (1u << TRAFFIC_BULK))
+		send_message(state->config, destinations, destinations_len, TRAFFIC_BULK, message);
+	else if (frame_classes & (1u << TRAFFIC_DROPPABLE))
+		send_motion(state, destinations[0], message);
+}
+
+static void forward_event(struct device_state* state, const struct input_event* ev) {
+	const struct runtime_config* config = state->config;
+	size_t device_index = state->device_index;
+	uint32_t device_id = config->device_specs[device_index].device_id;
+	struct event_message message_to_send = {
+		.device_id = device_id,
+		.event_type = ev->type,
+		.event_code = ev->code,
+		.event_value = ev->value,
+	};
+
+	if (update_layer_state(state, ev))
+		return;
+
+	if (ev->type == EV_KEY && ev->code < KEY_CNT && config->passthrough_table[ev->code]) {
+		struct event_message sync_message = {device_id, 0, 0, 0};
+		send_device_message(state, &config->passthrough_client, 1, TRAFFIC_PRIORITY, &message_to_send);
+		send_message(config, &config->passthrough_client, 1, TRAFFIC_PRIORITY, &sync_message);
+	} else {
+		size_t client_index = current_client;
+		const size_t* destinations = &client_index;
+		size_t destinations_len = 1;
+
+		/* current_client may have been set by a newer config with more clients than this one */
+		if (client_index >= config->clients_len)
+			client_index = 0;
+		if (config->route_clients_len[device_index] != 0) {
+			destinations = &config->route_clients[device_index * config->clients_len];
+			destinations_len = config->route_clients_len[device_index];
+		} else {
+			if (client_index != state->followed_client) {
+				release_followed_keys(state, state->followed_client);
+				state->followed_client = client_index;
+			}
+			if (state->cursors != NULL && move_cursor(state, client_index, ev))
+				return;
+		}
+		if ((state->abs != NULL || ev->type == EV_ABS) &&
+		    filter_abs_event(state, destinations, destinations_len, ev))
+			return;
+
+		if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+			end_frame(state, destinations, destinations_len, &message_to_send);
+		} else {
+			enum traffic_class traffic_class = event_traffic_class(state, ev, destinations_len);
+			state->frame_classes |= 1u << traffic_class;
+			/* The motion the bulk socket couldn't take goes first, a button must not be pressed before the
+			 * pointer got where it was pressed */
+			if (traffic_class == TRAFFIC_BULK && state->motion_pending && destinations_len == 1 &&
+			    destinations[0] == state->pending_motion_client)
+				state->motion_pending = send_pending_motion(state, destinations[0], TRAFFIC_BULK);
+			if (traffic_class == TRAFFIC_DROPPABLE)
+				send_motion(state, destinations[0], &message_to_send);
+			else
+				send_device_message(state, destinations, destinations_len, traffic_class,
+						    &message_to_send);
+		}
+		if (device_id == config->switchable_device && ev->type == EV_KEY) {
+			if (ev->code == config->switch_modifier)
+				switch_modifier_state = ev->value;
+			if (ev->code == config->switch_key)
+				switch_key_state = ev->value;
+
+			if (switch_modifier_state && switch_key_state)
+				switch_client();
+		}
+	}
+}
+
+/* Repeat events are dropped, controlled repeats keys itself with the delay and period announced for the device. A
+ * frame only made of a repeat event (and its scan code) isn't sent at all. */
+static void handle_event(struct device_state* state, const struct input_event* ev) {
+	if (ev->type == EV_MSC && ev->code == MSC_SCAN) {
+		state->held_scan = *ev;
+		state->scan_held = true;
+		return;
+	}
+	if (ev->type == EV_KEY && ev->value == 2) {
+		state->scan_held = false;
+		state->repeat_dropped = true;
+		return;
+	}
+
+	if (state->scan_held) {
+		state->scan_held = false;
+		forward_event(state, &state->held_scan);
+	}
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+		bool repeat_frame = state->repeat_dropped && state->frame_classes == 0;
+		state->repeat_dropped = false;
+		if (repeat_frame)
+			return;
+	}
+	forward_event(state, ev);
+}
+
+static void capture_event(struct capture_ring* ring, uint32_t device_id, const struct input_event* ev) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail == CAPTURE_RING_SIZE) {
+		atomic_fetch_add_explicit(&capture_dropped_frames, 1, memory_order_relaxed);
+		return;
+	}
+
+	struct capture_frame* frame = &ring->frames[head % CAPTURE_RING_SIZE];
+	frame->timestamp_us = (uint64_t)ev->input_event_sec * 1000000 + ev->input_event_usec;
+	frame->device_id = device_id;
+	frame->event_type = ev->type;
+	frame->event_code = ev->code;
+	frame->event_value = ev->value;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void* handle_one_device_thread(void* device_as_void) {
+	struct device* device = device_as_void;
+	struct device_state state = {0};
+#ifdef DONT_USE_LIBEVDEV_FOR_READING
+	int fd = libevdev_get_fd(device->libev);
+#endif
+
+	state.pointer_device = device->info.abs_codes != 0 || device->info.has_rel;
+
+	/* The thread may only be cancelled (by a reload removing the device) while it waits for an event */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_cleanup_push(stop_device_state, &state);
 	for (;;) {
 		struct input_event ev;
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 #ifdef DONT_USE_LIBEVDEV_FOR_READING
 		int ret = read(fd, &ev, sizeof(ev));
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (ret < 0) {
 			perror("read");
-			return NULL;
+			break;
 		} else if (ret != sizeof(ev)) {
 			fprintf(stderr, "read: Didn't supply a full input_event\n");
-			return NULL;
+			break;
 		} else {
 #else
-		int ret = libevdev_next_event(devices_libev[device_index], LIBEVDEV_READ_FLAG_NORMAL, &ev);
+		int ret = libevdev_next_event(device->libev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (ret < 0) {
 			fprintf(stderr, "libevdev_next_event: %s\n", strerror(-ret));
-			return NULL;
+			break;
 		} else {
 #endif
-			struct event_message message_to_send = {
-				.device_id = devices[device_index].device_id,
-				.event_type = ev.type,
-				.event_code = ev.code,
-				.event_value = ev.value,
-			};
-			bool did_passthrough = false;
-			if (ev.type == EV_KEY) {
-				for (size_t i = 0; i < sizeof(passthrough_keys) / sizeof(unsigned int); i++) {
-					if (passthrough_keys[i] == ev.code) {
-						struct event_message sync_message = {devices[device_index].device_id, 0,
-										     0, 0};
-						send_message(passthrough_client, &message_to_send);
-						send_message(passthrough_client, &sync_message);
-						did_passthrough = true;
-					}
+			rcu_read_lock(&device->rcu_seq);
+			const struct runtime_config* config = atomic_load(&current_config);
+			if (config->generation != state.config_generation) {
+				ssize_t device_index = -1;
+				for (size_t i = 0; i < config->devices_len; i++) {
+					if (config->devices[i] == device)
+						device_index = i;
 				}
+				update_device_state(&state, config, device_index);
 			}
-			if (!did_passthrough) {
-				send_message(current_client, &message_to_send);
-				if (devices[device_index].device_id == switchable_device && ev.type == EV_KEY) {
-					if (ev.code == switch_modifier)
-						switch_modifier_state = ev.value;
-					if (ev.code == switch_key)
-						switch_key_state = ev.value;
-
-					if (switch_modifier_state && switch_key_state)
-						switch_client();
-				}
+			if (state.device_index >= 0) {
+				if (device->capture_ring != NULL)
+					capture_event(device->capture_ring,
+						      config->device_specs[state.device_index].device_id, &ev);
+				handle_event(&state, &ev);
 			}
+			rcu_read_unlock(&device->rcu_seq);
 		}
 	}
 
+	rcu_read_lock(&device->rcu_seq);
+	pthread_cleanup_pop(1);
+	rcu_read_unlock(&device->rcu_seq);
+	atomic_store(&device->running, false);
 	return NULL;
 }
 
-static void signal_handler(int signo) {
-	switch (signo) {
-		case SIGINT:
-		case SIGTERM:
-			for (size_t i = 0; i < devices_len; i++)
-				/* Quite violent but should be fine */
-				pthread_kill(devices_thread[i], SIGKILL);
+static void read_device_info(const struct libevdev* libev, struct device_info* info) {
+	unsigned int code;
+
+	memset(info, 0, sizeof(struct device_info));
+	for (code = 0; code < INPUT_PROP_CNT; code++) {
+		if (libevdev_has_property(libev, code))
+			info->properties |= 1u << code;
+	}
+	for (code = 0; code < ABS_CNT; code++) {
+		const struct input_absinfo* absinfo = libevdev_get_abs_info(libev, code);
+		if (!libevdev_has_event_code(libev, EV_ABS, code) || absinfo == NULL)
+			continue;
+		info->abs_codes |= 1ull << code;
+		info->absinfo[code] = *absinfo;
+	}
+	info->has_rel = libevdev_has_event_type(libev, EV_REL);
+	info->has_repeat = libevdev_has_event_type(libev, EV_REP) &&
+			   libevdev_get_repeat(libev, &info->repeat[REP_DELAY], &info->repeat[REP_PERIOD]) == 0;
+}
+
+/* Sends to every client what controlled needs to create a device like the source one : its properties, the
+ * absinfo of its axes and its key repeat settings */
+static void announce_device(const struct runtime_config* config, uint32_t device_id, const struct device_info* info) {
+	unsigned int code;
+
+	if (info->abs_codes == 0 && !info->has_repeat)
+		return;
+	for (code = 0; info->has_repeat && code < REP_CNT; code++) {
+		struct event_message message = {device_id, INMPX_EV_REP, code, info->repeat[code]};
+		send_message(config, config->all_clients, config->clients_len, TRAFFIC_DROPPABLE, &message);
+	}
+	for (code = 0; code < INPUT_PROP_CNT; code++) {
+		struct event_message message = {device_id, INMPX_EV_PROPERTY, code, 1};
+		if (info->properties & (1u << code))
+			send_message(config, config->all_clients, config->clients_len, TRAFFIC_DROPPABLE, &message);
+	}
+	for (code = 0; code < ABS_CNT; code++) {
+		const struct input_absinfo* absinfo = &info->absinfo[code];
+		if (!(info->abs_codes & (1ull << code)))
+			continue;
+		/* The resolution is sent last, controlled considers the axis described once it's received */
+		const struct event_message messages[] = {
+			{device_id, INMPX_EV_ABS_MINIMUM, code, absinfo->minimum},
+			{device_id, INMPX_EV_ABS_MAXIMUM, code, absinfo->maximum},
+			{device_id, INMPX_EV_ABS_FUZZ, code, absinfo->fuzz},
+			{device_id, INMPX_EV_ABS_FLAT, code, absinfo->flat},
+			{device_id, INMPX_EV_ABS_RESOLUTION, code, absinfo->resolution},
+		};
+		for (size_t j = 0; j < sizeof(messages) / sizeof(struct event_message); j++)
+			send_message(config, config->all_clients, config->clients_len, TRAFFIC_DROPPABLE,
+				     &messages[j]);
+	}
+	struct event_message end_message = {device_id, INMPX_EV_ANNOUNCE_END, 0, 0};
+	send_message(config, config->all_clients, config->clients_len, TRAFFIC_DROPPABLE, &end_message);
+}
+
+static void announce_devices(const struct runtime_config* config) {
+	for (size_t i = 0; i < config->devices_len; i++) {
+		if (config->devices[i] != NULL)
+			announce_device(config, config->device_specs[i].device_id, &config->devices[i]->info);
+	}
+}
+
+static void release_client(struct client* cli) {
+	if (--cli->refcount != 0)
+		return;
+	close(cli->fd);
+	free(cli->addr);
+	if (cli->priority_fd >= 0)
+		close(cli->priority_fd);
+	free(cli->priority_addr);
+	free(cli->address);
+	free(cli);
+}
+
+static void release_device(struct device* device) {
+	int fd;
+
+	if (--device->refcount != 0)
+		return;
+	if (device->thread_started) {
+		pthread_cancel(device->thread);
+		pthread_join(device->thread, NULL);
+	}
+	/* Closing the file descriptor releases the grab */
+	fd = libevdev_get_fd(device->libev);
+	libevdev_free(device->libev);
+	close(fd);
+	free(device->capture_ring);
+	free(device->path);
+	free(device->name);
+	free(device);
+}
+
+/* Drops the clients and devices held by config, the ones not used by any other config are closed */
+static void release_config_resources(struct runtime_config* config) {
+	for (size_t i = 0; i < config->clients_len; i++) {
+		if (config->clients[i] != NULL)
+			release_client(config->clients[i]);
+	}
+	for (size_t i = 0; i < config->devices_len; i++) {
+		if (config->devices[i] != NULL)
+			release_device(config->devices[i]);
+	}
+}
+
+/* Gives config its clients and devices, reusing the ones of old_config (which may be NULL) that didn't change so
+ * their sockets, grabs and threads keep working during a reload */
+static int attach_config(struct runtime_config* config, const struct runtime_config* old_config, bool open_devices) {
+	static unsigned long last_generation = 0;
+	size_t i, j;
+
+	config->generation = ++last_generation;
+	config->clients = calloc(config->clients_len, sizeof(struct client*));
+	config->devices = calloc(config->devices_len + 1, sizeof(struct device*));
+	assert(config->clients != NULL && config->devices != NULL);
+
+	for (i = 0; i < config->clients_len; i++) {
+		const struct client_spec* spec = &config->client_specs[i];
+		for (j = 0; old_config != NULL && j < old_config->clients_len; j++) {
+			struct client* old_cli = old_config->clients[j];
+			if (old_cli->listen_mode == spec->listen_mode && old_cli->port == spec->port &&
+			    strcmp(old_cli->address, spec->address) == 0) {
+				config->clients[i] = old_cli;
+				old_cli->refcount++;
+				break;
+			}
+		}
+		if (config->clients[i] != NULL)
+			continue;
+
+		struct client* cli = calloc(1, sizeof(struct client));
+		assert(cli != NULL);
+		cli->fd = open_client(spec, false, &cli->addr);
+		if (cli->fd < 0) {
+			free(cli);
+			return -1;
+		}
+		cli->priority_fd = -1;
+#ifdef PRIORITY_SOCKET
+		cli->priority_fd = open_client(spec, true, &cli->priority_addr);
+		if (cli->priority_fd < 0) {
+			close(cli->fd);
+			free(cli->addr);
+			free(cli);
+			return -1;
+		}
+#endif
+		cli->listen_mode = spec->listen_mode;
+		cli->address = strdup_or_null(spec->address);
+		cli->port = spec->port;
+		cli->addrlen =
+			spec->listen_mode == LISTEN_NETWORK ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_un);
+		cli->refcount = 1;
+		config->clients[i] = cli;
+	}
+
+	for (i = 0; open_devices && i < config->devices_len; i++) {
+		const struct device_spec* spec = &config->device_specs[i];
+		for (j = 0; old_config != NULL && j < old_config->devices_len; j++) {
+			struct device* old_device = old_config->devices[j];
+			/* A device whose thread stopped (unplugged...) is opened again */
+			if (strcmp(old_device->path, spec->path) == 0 && atomic_load(&old_device->running)) {
+				config->devices[i] = old_device;
+				old_device->refcount++;
+				break;
+			}
+		}
+		if (config->devices[i] != NULL)
+			continue;
+
+		struct device* device = calloc(1, sizeof(struct device));
+		assert(device != NULL);
+		device->libev = open_device(spec->path);
+		if (device->libev == NULL) {
+			free(device);
+			return -1;
+		}
+		read_device_info(device->libev, &device->info);
+		device->path = strdup_or_null(spec->path);
+		device->name = strdup_or_null(libevdev_get_name(device->libev));
+		device->refcount = 1;
+		if (capture_running) {
+			device->capture_ring = calloc(1, sizeof(struct capture_ring));
+			assert(device->capture_ring != NULL);
+		}
+		config->devices[i] = device;
+	}
+	return 0;
+}
+
+static void start_device_threads(struct runtime_config* config) {
+	for (size_t i = 0; i < config->devices_len; i++) {
+		struct device* device = config->devices[i];
+		if (device == NULL || device->thread_started)
+			continue;
+		atomic_store(&device->running, true);
+		device->thread_started = true;
+		pthread_create(&device->thread, NULL, handle_one_device_thread, device);
+	}
+}
+
+static void reload_config(void) {
+	struct runtime_config* old_config = atomic_load(&current_config);
+	struct runtime_config* new_config;
+	int ret;
+
+	if (config_path == NULL) {
+		fprintf(stderr, "reload_config: No configuration file to reload\n");
+		return;
+	}
+	new_config = load_config_file(config_path);
+	if (new_config == NULL)
+		return;
+	if (compile_config(new_config) < 0 || attach_config(new_config, old_config, true) < 0) {
+		fprintf(stderr, "reload_config: Keeping the previous configuration\n");
+		if (new_config->clients != NULL)
+			release_config_resources(new_config);
+		free_config(new_config);
+		return;
+	}
+
+	ret = pthread_mutex_lock(&current_client_lock);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_mutex_lock: %s\n", strerror(ret));
+		abort();
+	}
+	/* 0 is valid in both configs, readers of the old one may still see current_client after the swap */
+	if (current_client >= new_config->clients_len)
+		current_client = 0;
+	atomic_store(&current_config, new_config);
+	ret = pthread_mutex_unlock(&current_client_lock);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_mutex_unlock: %s\n", strerror(ret));
+		abort();
+	}
+
+	start_device_threads(new_config);
+	announce_devices(new_config);
+	wait_for_readers(old_config);
+	release_config_resources(old_config);
+	free_config(old_config);
+	fprintf(stderr, "reload_config: Loaded %s\n", config_path);
+}
+
+static int capture_write(const void* data, size_t data_len) {
+	while (data_len > 0 && capture_fd >= 0) {
+		ssize_t written = write(capture_fd, data, data_len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			/* The capture is stopped but events are still sent to clients */
+			perror("write");
+			close(capture_fd);
+			capture_fd = -1;
+			return -1;
+		}
+		data = (const uint8_t*)data + written;
+		data_len -= written;
+	}
+	return 0;
+}
+
+/* Merges the frames buffered by every device by timestamp and writes them to the capture file */
+static void capture_flush(void) {
+	struct capture_frame batch[256];
+	size_t batch_len = 0;
+
+	rcu_read_lock(&capture_rcu_seq);
+	const struct runtime_config* config = atomic_load(&current_config);
+	struct capture_ring* rings[config->devices_len + 1];
+	size_t heads[config->devices_len + 1];
+	size_t tails[config->devices_len + 1];
+	size_t i;
+
+	for (i = 0; i < config->devices_len; i++) {
+		rings[i] = config->devices[i]->capture_ring;
+		heads[i] = atomic_load_explicit(&rings[i]->head, memory_order_acquire);
+		tails[i] = atomic_load_explicit(&rings[i]->tail, memory_order_relaxed);
+		uint32_t device_id = config->device_specs[i].device_id;
+		if (!rings[i]->described || rings[i]->described_id != device_id) {
+			struct capture_frame device_frame = {0, device_id, CAPTURE_EV_DEVICE, 0, 0};
+			struct capture_device device = {.device_id = device_id};
+			if (config->devices[i]->name != NULL)
+				strncpy(device.device_name, config->devices[i]->name, sizeof(device.device_name) - 1);
+			memcpy(&device.info, &config->devices[i]->info, sizeof(struct device_info));
+			capture_write(&device_frame, sizeof(device_frame));
+			capture_write(&device, sizeof(device));
+			rings[i]->described = true;
+			rings[i]->described_id = device_id;
+		}
+	}
+
+	for (;;) {
+		const struct capture_frame* oldest_frame = NULL;
+		ssize_t oldest = -1;
+		for (i = 0; i < config->devices_len; i++) {
+			const struct capture_frame* frame = &rings[i]->frames[tails[i] % CAPTURE_RING_SIZE];
+			if (tails[i] != heads[i] && (oldest < 0 || frame->timestamp_us < oldest_frame->timestamp_us)) {
+				oldest = i;
+				oldest_frame = frame;
+			}
+		}
+		if (oldest < 0)
 			break;
-		default:
+
+		batch[batch_len++] = *oldest_frame;
+		tails[oldest]++;
+		atomic_store_explicit(&rings[oldest]->tail, tails[oldest], memory_order_release);
+		if (batch_len == sizeof(batch) / sizeof(struct capture_frame)) {
+			capture_write(batch, sizeof(batch));
+			batch_len = 0;
+		}
+	}
+	rcu_read_unlock(&capture_rcu_seq);
+	capture_write(batch, batch_len * sizeof(struct capture_frame));
+}
+
+static void* capture_thread_main(void* unused) {
+	const struct timespec flush_interval = {0, CAPTURE_FLUSH_INTERVAL_NS};
+	(void)unused;
+
+	while (!atomic_load(&capture_stop_triggered)) {
+		nanosleep(&flush_interval, NULL);
+		capture_flush();
+	}
+	capture_flush();
+
+	size_t dropped_frames = atomic_load(&capture_dropped_frames);
+	if (dropped_frames != 0)
+		fprintf(stderr, "capture: %zu events were dropped\n", dropped_frames);
+	if (capture_fd >= 0 && close(capture_fd) < 0)
+		perror("close");
+	return NULL;
+}
+
+static int start_capture(const char* capture_path, struct runtime_config* config) {
+	struct capture_header header = {CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(struct capture_frame),
+					sizeof(struct capture_device)};
+
+	capture_fd = open(capture_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (capture_fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (capture_write(&header, sizeof(header)) < 0)
+		return -1;
+	/* Devices are described in the file by capture_flush. Devices opened by later reloads get their ring in
+	 * attach_config. */
+	for (size_t i = 0; i < config->devices_len; i++) {
+		config->devices[i]->capture_ring = calloc(1, sizeof(struct capture_ring));
+		assert(config->devices[i]->capture_ring != NULL);
+	}
+
+	capture_running = true;
+	pthread_create(&capture_thread, NULL, capture_thread_main, NULL);
+	return 0;
+}
+
+static void stop_capture(void) {
+	if (!capture_running)
+		return;
+	atomic_store(&capture_stop_triggered, true);
+	pthread_join(capture_thread, NULL);
+}
+
+/* Pushes a capture through handle_event, the time between events is divided by speed or ignored if speed is 0 */
+static int replay_capture(const char* capture_path, double speed) {
+	const struct runtime_config* config = atomic_load(&current_config);
+	const struct capture_header* header;
+	struct device_state states[config->devices_len + 1];
+	struct stat capture_stat;
+	struct timespec start, end;
+	size_t events_len = 0, offset, i;
+	uint64_t first_timestamp_us = 0;
+	uint8_t* capture;
+	/* Descriptions of the devices of config, read from the capture */
+	struct device_info infos[config->devices_len + 1];
+	bool described[config->devices_len + 1];
+	struct timespec last_announce;
+
+	int fd = open(capture_path, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (fstat(fd, &capture_stat) < 0) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)capture_stat.st_size < sizeof(struct capture_header)) {
+		fprintf(stderr, "replay_capture: Truncated capture\n");
+		close(fd);
+		return -1;
+	}
+	capture = mmap(NULL, capture_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (capture == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	madvise(capture, capture_stat.st_size, MADV_SEQUENTIAL);
+
+	header = (const struct capture_header*)capture;
+	if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION ||
+	    header->frame_size != sizeof(struct capture_frame) ||
+	    header->device_size != sizeof(struct capture_device)) {
+		fprintf(stderr, "replay_capture: Invalid capture header\n");
+		munmap(capture, capture_stat.st_size);
+		return -1;
+	}
+
+	memset(states, 0, sizeof(states));
+	memset(described, 0, sizeof(described));
+	for (i = 0; i < config->devices_len; i++)
+		update_device_state(&states[i], config, i);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_announce = start;
+	/* A trailing partial record is ignored, the controller might have been killed in the middle of a write */
+	offset = sizeof(struct capture_header);
+	while (offset + sizeof(struct capture_frame) <= (size_t)capture_stat.st_size) {
+		const struct capture_frame* frame = (const struct capture_frame*)(capture + offset);
+		offset += sizeof(struct capture_frame);
+
+		if (frame->event_type == CAPTURE_EV_DEVICE) {
+			const struct capture_device* device = (const struct capture_device*)(capture + offset);
+			offset += sizeof(struct capture_device);
+			if (offset > (size_t)capture_stat.st_size)
+				break;
+			ssize_t device_index = find_device_index(config, device->device_id);
+			if (device_index < 0) {
+				fprintf(stderr,
+					"replay_capture: Events of unknown device %08X (%.60s) will be ignored\n",
+					device->device_id, device->device_name);
+				continue;
+			}
+			/* Devices with absolute axes are only created by controlled once announced */
+			memcpy(&infos[device_index], &device->info, sizeof(struct device_info));
+			described[device_index] = true;
+			states[device_index].pointer_device = device->info.abs_codes != 0 || device->info.has_rel;
+			announce_device(config, device->device_id, &infos[device_index]);
+			continue;
+		}
+
+		if (events_len++ == 0)
+			first_timestamp_us = frame->timestamp_us;
+		if (speed > 0 && frame->timestamp_us > first_timestamp_us) {
+			uint64_t offset_ns = (frame->timestamp_us - first_timestamp_us) * 1000 / speed;
+			uint64_t target_ns = start.tv_sec * 1000000000ull + start.tv_nsec + offset_ns;
+			struct timespec target = {target_ns / 1000000000, target_ns % 1000000000};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR)
+				;
+		}
+
+		/* Announced again like live devices for the controlled started during the replay */
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if ((end.tv_sec - last_announce.tv_sec) * 1000 + (end.tv_nsec - last_announce.tv_nsec) / 1000000 >=
+		    ANNOUNCE_INTERVAL_MS) {
+			for (i = 0; i < config->devices_len; i++) {
+				if (described[i])
+					announce_device(config, config->device_specs[i].device_id, &infos[i]);
+			}
+			last_announce = end;
+		}
+
+		ssize_t device_index = find_device_index(config, frame->device_id);
+		if (device_index < 0)
+			continue;
+		struct input_event ev = {
+			.type = frame->event_type,
+			.code = frame->event_code,
+			.value = frame->event_value,
+		};
+		handle_event(&states[device_index], &ev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "replay_capture: %zu events replayed in %.3fs (%.0f events/s)\n", events_len, elapsed,
+		elapsed > 0 ? events_len / elapsed : 0);
+	for (i = 0; i < config->devices_len; i++)
+		free_device_state(&states[i]);
+	munmap(capture, capture_stat.st_size);
+	return 0;
+}
+
+/* Returns on SIGINT or SIGTERM, reloads the configuration on SIGHUP and when the configuration file changes.
+ * Devices are announced again whenever nothing happened for ANNOUNCE_INTERVAL_MS. */
+static void main_loop(const sigset_t* handled_signals) {
+	struct pollfd fds[2] = {{.fd = -1, .events = POLLIN}, {.fd = -1, .events = POLLIN}};
+
+	fds[0].fd = signalfd(-1, handled_signals, SFD_CLOEXEC);
+	if (fds[0].fd < 0) {
+		perror("signalfd");
+		return;
+	}
+	if (config_path != NULL)
+		fds[1].fd = watch_config_file(config_path);
+
+	for (;;) {
+		int ready = poll(fds, 2, ANNOUNCE_INTERVAL_MS);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			break;
+		} else if (ready == 0) {
+			announce_devices(atomic_load(&current_config));
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			struct signalfd_siginfo siginfo;
+			if (read(fds[0].fd, &siginfo, sizeof(siginfo)) != sizeof(siginfo)) {
+				perror("read");
+				break;
+			}
+			if (siginfo.ssi_signo != SIGHUP)
+				break;
+			reload_config();
+		}
+		if (fds[1].fd >= 0 && (fds[1].revents & POLLIN) && config_file_changed(fds[1].fd, config_path))
+			reload_config();
 	}
+
+	close(fds[0].fd);
+	if (fds[1].fd >= 0)
+		close(fds[1].fd);
 }
 
-int main(void) {
-	size_t i;
+static void usage(const char* argv0) {
+	fprintf(stderr,
+		"Usage: %s [-f config_file] [-c capture_file | -r capture_file [-s speed]]\n"
+		"  -f config_file   read the configuration from config_file instead of controller.config.h, it is\n"
+		"                   reloaded on SIGHUP and whenever the file changes\n"
+		"  -c capture_file  record every event read from the devices to capture_file\n"
+		"  -r capture_file  send the events of capture_file instead of reading the devices\n"
+		"  -s speed         replay speed multiplier, 0 replays as fast as possible (default: 1)\n",
+		argv0);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	const char* capture_path = NULL;
+	const char* replay_path = NULL;
+	double replay_speed = 1;
+	struct runtime_config* config;
+	sigset_t handled_signals;
+
+	while ((opt = getopt(argc, argv, "f:c:r:s:")) != -1) {
+		switch (opt) {
+			case 'f':
+				config_path = optarg;
+				break;
+			case 'c':
+				capture_path = optarg;
+				break;
+			case 'r':
+				replay_path = optarg;
+				break;
+			case 's':
+				replay_speed = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+	if (optind != argc || (capture_path != NULL && replay_path != NULL) || replay_speed < 0) {
+		usage(argv[0]);
+		return -1;
+	}
 
 #ifdef ENCRYPTED_CONNECTION
 	if (read_encryption_key() < 0) {
@@ -293,30 +2361,34 @@ int main(void) {
 	}
 #endif
 
-	for (i = 0; i < clients_len; i++) {
-		struct sockaddr* addr;
-		clients_fd[i] = open_client(&clients[i], &addr);
-		if (clients_fd[i] < 0) {
-			return -1;
-		}
-		clients_addr[i] = addr;
+	config = config_path != NULL ? load_config_file(config_path) : load_default_config();
+	if (config == NULL || compile_config(config) < 0 || attach_config(config, NULL, replay_path == NULL) < 0) {
+		return -1;
 	}
-	for (i = 0; i < devices_len; i++) {
-		devices_libev[i] = open_device(&devices[i]);
-		if (devices_libev[i] == NULL) {
-			return -1;
-		}
+	atomic_store(&current_config, config);
+
+	if (replay_path != NULL) {
+		pthread_create(&postswitch_thread, NULL, postswitch_thread_main, NULL);
+		return replay_capture(replay_path, replay_speed);
 	}
 
-	for (i = 0; i < devices_len; i++)
-		pthread_create(&devices_thread[i], NULL, handle_one_device_thread, (void*)i);
+	/* Every thread inherits this mask so these signals are only received through main_loop's signalfd, it must thus
+	 * be set before any thread is created */
+	sigemptyset(&handled_signals);
+	sigaddset(&handled_signals, SIGINT);
+	sigaddset(&handled_signals, SIGTERM);
+	sigaddset(&handled_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &handled_signals, NULL);
 
-	struct sigaction int_handler = {.sa_handler = signal_handler};
-	sigaction(SIGINT, &int_handler, NULL);
-	sigaction(SIGTERM, &int_handler, NULL);
+	if (capture_path != NULL && start_capture(capture_path, config) < 0) {
+		return -1;
+	}
 
-	for (i = 0; i < devices_len; i++)
-		pthread_join(devices_thread[i], NULL);
+	pthread_create(&postswitch_thread, NULL, postswitch_thread_main, NULL);
+	start_device_threads(config);
+	announce_devices(config);
+	main_loop(&handled_signals);
+	stop_capture();
 
 	/* evdev seems to release the grab by itself, let's keep it simple */
 	return 0;
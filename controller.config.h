@@ -4,6 +4,10 @@
 #define KBRD 0x4B425244
 #define MOUS 0x4D4F5553
 
+/* The tables of this file are the configuration used when the controller is started without -f, a configuration file
+ * (see controller.conf.example) overrides all of them and can be reloaded while the controller is running. The other
+ * settings are compile-time only. */
+
 struct device_config {
 	const char* device_path;
 	const uint32_t device_id;
@@ -16,6 +20,36 @@ struct client_config {
 	const char* postswitch_command;
 };
 
+struct route_config {
+	const uint32_t device_id;
+	const size_t* clients;
+};
+
+struct layer_config {
+	const uint32_t device_id;
+	const unsigned int layer_key;
+	const unsigned int layer;
+};
+
+struct remap_config {
+	const uint32_t device_id;
+	const size_t client;
+	const unsigned int layer;
+	const unsigned int from;
+	const enum { REMAP_CHORD, REMAP_MACRO } mode;
+	const unsigned int* to;
+};
+
+struct screen_config {
+	const size_t client;
+	const int32_t width;
+	const int32_t height;
+	const size_t left;
+	const size_t right;
+	const size_t up;
+	const size_t down;
+};
+
 static const struct client_config clients[] = {
 	{"127.0.0.1", 63333, LISTEN_NETWORK, "ddcutil --bus=2 setvcp 60 0x0F"},
 	{"/tmp/inmpx-controlled.socket", 0, LISTEN_UNIX, "ddcutil --bus=2 setvcp 60 0x11"},
@@ -31,6 +65,70 @@ static const unsigned int switch_key = KEY_SCROLLLOCK;
 static const unsigned int passthrough_keys[] = {KEY_RIGHTMETA};
 static const size_t passthrough_client = 0;
 
+/* Comment / Uncomment this line to enable per-device routing
+ * Devices listed in routes are always sent to the -1 terminated list of indexes in clients instead of the currently
+ * selected client, listing several clients mirrors the device to all of them (each event is still only encrypted
+ * once). Devices without a route follow the currently selected client and passthrough_keys still go to
+ * clients[passthrough_client].
+ */
+// #define DEVICE_ROUTING
+#ifdef DEVICE_ROUTING
+static const struct route_config routes[] = {
+	{MOUS, (const size_t[]){0, 1, -1}},
+};
+#endif
+
+/* Comment / Uncomment this line to enable in-process key remapping
+ * Remapping happens right before events are sent, switch_modifier, switch_key and passthrough_keys are thus always
+ * matched against the physical keys. The tables below are compiled at startup into flat per-device arrays indexed by
+ * key code so remapping doesn't slow down the event path.
+ */
+// #define KEY_REMAPPING
+/* Highest layer number + 1, layer 0 is the one active when no layer key is held */
+#define REMAP_LAYERS 4
+/* Layers are stored in the uint8_t layer_table and are bits of the unsigned int layer_state */
+_Static_assert(REMAP_LAYERS <= UINT8_MAX && REMAP_LAYERS <= sizeof(unsigned int) * 8, "REMAP_LAYERS is too high");
+#define REMAP_ALL_CLIENTS ((size_t)-1)
+#ifdef KEY_REMAPPING
+/* Holding layer_key on device with id device_id activates the given layer on this device. Layer keys are never sent to
+ * clients and the highest layer wins when several layer keys are held. */
+static const struct layer_config layers[] = {
+	{KBRD, KEY_CAPSLOCK, 1},
+};
+
+/* Each entry replaces the key `from` of device with id device_id by the -1 terminated list of keys `to` when `layer` is
+ * active and the event is sent to clients[client] (or to any client with REMAP_ALL_CLIENTS) :
+ * - REMAP_CHORD : keys are pressed in order when `from` is pressed and released in reverse order when it is released
+ * - REMAP_MACRO : keys are typed one after the other when `from` is pressed, nothing is sent when it is released
+ */
+static const struct remap_config remaps[] = {
+	{KBRD, REMAP_ALL_CLIENTS, 1, KEY_H, REMAP_CHORD, (const unsigned int[]){KEY_LEFT, -1}},
+	{KBRD, REMAP_ALL_CLIENTS, 1, KEY_J, REMAP_CHORD, (const unsigned int[]){KEY_DOWN, -1}},
+	{KBRD, REMAP_ALL_CLIENTS, 1, KEY_K, REMAP_CHORD, (const unsigned int[]){KEY_UP, -1}},
+	{KBRD, REMAP_ALL_CLIENTS, 1, KEY_L, REMAP_CHORD, (const unsigned int[]){KEY_RIGHT, -1}},
+	{KBRD, 1, 1, KEY_T, REMAP_CHORD, (const unsigned int[]){KEY_LEFTCTRL, KEY_LEFTALT, KEY_T, -1}},
+	{KBRD, REMAP_ALL_CLIENTS, 1, KEY_E, REMAP_MACRO, (const unsigned int[]){KEY_L, KEY_S, KEY_ENTER, -1}},
+};
+#endif
+
+/* Comment / Uncomment this line to enable screen edge switching
+ * The relative motion of device with id edge_switching_device is tracked as a virtual cursor on the screen of each
+ * client listed in screens. When the cursor leaves a screen through an edge with a neighbour (an index in clients or
+ * NO_NEIGHBOUR), the controller switches to the neighbour and moves its cursor to where it entered, keeping its
+ * relative position along the edge. No switch happens while a button is held so dragging stops at edges.
+ * The virtual cursor only matches the real one if clients use a flat pointer acceleration profile (e.g. with libinput,
+ * `xinput set-prop <device> "libinput Accel Profile Enabled" 0 1`). edge_switching_device must not be routed.
+ */
+#define NO_NEIGHBOUR ((size_t)-1)
+// #define EDGE_SWITCHING
+#ifdef EDGE_SWITCHING
+static const uint32_t edge_switching_device = MOUS;
+static const struct screen_config screens[] = {
+	{0, 1920, 1080, NO_NEIGHBOUR, 1, NO_NEIGHBOUR, NO_NEIGHBOUR},
+	{1, 2560, 1440, 0, NO_NEIGHBOUR, NO_NEIGHBOUR, NO_NEIGHBOUR},
+};
+#endif
+
 static const struct device_config devices[] = {
 	{"/dev/input/by-path/platform-i8042-serio-0-event-kbd", KBRD},
 	{"/dev/input/by-path/platform-i8042-serio-1-event-mouse", MOUS},
@@ -56,6 +154,17 @@ static const char encryption_context[hydro_secretbox_CONTEXTBYTES] = "!INMPX!";
 static const unsigned int encryption_time_divison = 1;
 #endif
 
+/* Comment / Uncomment this line to enable the priority socket
+ * Key events of devices without axes (keyboards) are sent through a second socket, marked with SO_PRIORITY and the
+ * DSCP class EF, to the priority socket of controlled which listens on the port of the client + 1 or on its path with
+ * the "-priority" suffix. They thus never wait behind motion in socket buffers or on the network. Buttons of mice,
+ * touchpads and tablets stay ordered with their motion so clicks land where the pointer is. It must also be enabled
+ * in controlled.config.h.
+ * Whether it's enabled or not, relative motion going to a single client is dropped and coalesced with the next motion
+ * instead of waiting when the socket is full.
+ */
+#define PRIORITY_SOCKET
+
 /* Comment / Uncomment this line to use read(2) instead of libevdev_next_event
  * I have encountered some issues with libevdev_next_event on some devices. Not all the events were being dispatched.
  * Prefer enabling this flag only if you notice this kind of problem beacause going through libevdev is the recommanded